@@ -0,0 +1,248 @@
+/* MTSAS GPS sentence parsing
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MTSASGps.h"
+
+////////////////////////////////////////////////////////////////////////
+//GPS sentence parsing
+////////////////////////////////////////////////////////////////////////
+//The parsers make a single pass over the sentence, checking every read
+//against the end of the line, and produce fixed point values directly
+
+struct gps_cursor {
+    const char *p;
+    const char *end;
+};
+
+static const uint32_t gps_pow10[] = {1, 10, 100, 1000, 10000, 100000, 1000000};
+
+static bool cursor_skip(gps_cursor *c, char ch){
+    if (c->p < c->end && *c->p == ch){
+        c->p++;
+        return true;
+    }
+    return false;
+}
+
+static bool cursor_match(gps_cursor *c, const char *str){
+    const char *p = c->p;
+    for (; *str; str++, p++){
+        if (p >= c->end || *p != *str){
+            return false;
+        }
+    }
+    c->p = p;
+    return true;
+}
+
+static bool skip_field(gps_cursor *c){
+    while (c->p < c->end && *c->p != ','){
+        c->p++;
+    }
+    return cursor_skip(c, ',');
+}
+
+//Consume a run of digits, accumulating at most max of them
+//Returns the number of digits consumed
+static int parse_digits(gps_cursor *c, int max, uint32_t *value){
+    int n = 0;
+    uint32_t v = 0;
+    while (c->p < c->end && *c->p >= '0' && *c->p <= '9'){
+        if (n < max){
+            v = v * 10 + (*c->p - '0');
+        }
+        n++;
+        c->p++;
+    }
+    *value = v;
+    return n;
+}
+
+//Consume the fractional part of a number, if any, scaled to 10^digits
+static uint32_t parse_fraction(gps_cursor *c, int digits){
+    uint32_t frac = 0;
+    int n = 0;
+    if (cursor_skip(c, '.')){
+        n = parse_digits(c, digits, &frac);
+    }
+    //Extra digits are truncated
+    return (n >= digits) ? frac : frac * gps_pow10[digits - n];
+}
+
+static bool parse_uint(gps_cursor *c, int max_digits, uint32_t *value){
+    int n = parse_digits(c, max_digits, value);
+    return n > 0 && n <= max_digits;
+}
+
+//hhmmss.sss into milliseconds since midnight
+static bool parse_time(gps_cursor *c, uint32_t *value){
+    uint32_t hhmmss;
+    if (parse_digits(c, 6, &hhmmss) != 6){
+        return false;
+    }
+    uint32_t ms = parse_fraction(c, 3);
+    uint32_t h = hhmmss / 10000;
+    uint32_t m = hhmmss / 100 % 100;
+    uint32_t s = hhmmss % 100;
+    if (h > 23 || m > 59 || s > 60){
+        return false;
+    }
+    *value = ((h * 60 + m) * 60 + s) * 1000 + ms;
+    return true;
+}
+
+//ddmm.mmmm or dddmm.mmmm into micro-degrees
+static bool parse_coordinate(gps_cursor *c, uint32_t max_degrees, int32_t *value){
+    uint32_t dm;
+    int n = parse_digits(c, 5, &dm);
+    if (n < 3 || n > 5){
+        return false;
+    }
+    uint32_t degrees = dm / 100;
+    uint32_t minutes = (dm % 100) * 1000000 + parse_fraction(c, 6);
+    if (minutes >= 60000000){
+        return false;
+    }
+    uint32_t micro = degrees * 1000000 + minutes / 60;
+    if (degrees > max_degrees || micro > max_degrees * 1000000){
+        return false;
+    }
+    *value = (int32_t)micro;
+    return true;
+}
+
+/**
+According to ISO 6709:
+    North latitude is positive
+    East longitude is positive
+**/
+static bool parse_hemisphere(gps_cursor *c, char positive, char negative, int32_t *value){
+    if (cursor_skip(c, negative)){
+        *value = -*value;
+        return true;
+    }
+    return cursor_skip(c, positive);
+}
+
+//Metres into centimetres
+static bool parse_altitude(gps_cursor *c, int32_t *value){
+    bool negative = cursor_skip(c, '-');
+    uint32_t metres;
+    if (!parse_uint(c, 6, &metres)){
+        return false;
+    }
+    int32_t cm = (int32_t)(metres * 100 + parse_fraction(c, 2));
+    *value = negative ? -cm : cm;
+    return true;
+}
+
+static int hex_digit(char ch){
+    if (ch >= '0' && ch <= '9'){
+        return ch - '0';
+    }
+    if (ch >= 'A' && ch <= 'F'){
+        return ch - 'A' + 10;
+    }
+    if (ch >= 'a' && ch <= 'f'){
+        return ch - 'a' + 10;
+    }
+    return -1;
+}
+
+//The checksum of an NMEA sentence is the XOR of the characters between the
+//'$' and the '*', sent as two hex digits after the '*'. It is optional
+static bool check_nmea_sum(const char *p, const char *end){
+    uint8_t sum = 0;
+    for (; p < end && *p != '*'; p++){
+        sum ^= (uint8_t)*p;
+    }
+    if (p == end){
+        return true;
+    }
+    int high = (end - p > 2) ? hex_digit(p[1]) : -1;
+    int low = (end - p > 2) ? hex_digit(p[2]) : -1;
+    return high >= 0 && low >= 0 && ((high << 4) | low) == sum;
+}
+
+bool gps_parse_acp(const char *line, unsigned len, gps_fix *fix){
+    /**
+    Response from the radio is:
+    $GPSACP: <UTC>,<latitude>,<longitude>,<hdop>,<altitude>,<fix>,<cog>,<spkm>,<spkn>,<date>,<nsat>
+    where:
+    <UTC> - hhmmss.sss
+    <latitude> - ddmm.mmmm N/S
+    <longitude> - dddmm.mmmm E/W
+    <altitude> - metres
+    <fix> - 0 or 1 invalid, 2 2D fix, 3 3D fix
+    <date> - ddmmyy
+    **/
+    gps_cursor c = {line, line + len};
+    gps_fix f;
+    uint32_t quality;
+    uint32_t satellites;
+    cursor_match(&c, "$GPSACP:");
+    while (cursor_skip(&c, ' '));
+    if (!parse_time(&c, &f.time) || !cursor_skip(&c, ',') ||
+        !parse_coordinate(&c, 90, &f.latitude) || !parse_hemisphere(&c, 'N', 'S', &f.latitude) ||
+        !cursor_skip(&c, ',') ||
+        !parse_coordinate(&c, 180, &f.longitude) || !parse_hemisphere(&c, 'E', 'W', &f.longitude) ||
+        !cursor_skip(&c, ',') || !skip_field(&c) ||
+        !parse_altitude(&c, &f.altitude) || !cursor_skip(&c, ',') ||
+        !parse_uint(&c, 1, &quality) || !cursor_skip(&c, ',') ||
+        !skip_field(&c) || !skip_field(&c) || !skip_field(&c) ||
+        !parse_uint(&c, 6, &f.date) || !cursor_skip(&c, ',') ||
+        !parse_uint(&c, 2, &satellites) || quality < 2){
+        return false;
+    }
+    f.quality = quality;
+    f.satellites = satellites;
+    *fix = f;
+    return true;
+}
+
+bool gps_parse_gga(const char *line, unsigned len, gps_fix *fix){
+    /**
+    GGA sentence from the NMEA stream:
+    $xxGGA,<UTC>,<latitude>,N/S,<longitude>,E/W,<quality>,<satellites>,<hdop>,<altitude>,M,...
+    Fields are left empty while the receiver has no fix
+    **/
+    gps_cursor c = {line, line + len};
+    gps_fix f;
+    uint32_t quality;
+    uint32_t satellites;
+    while (cursor_skip(&c, ' '));
+    //Skip the talker id, GP for GPS only or GN for multiple constellations
+    if (!cursor_skip(&c, '$') || !check_nmea_sum(c.p, c.end) || c.end - c.p < 2){
+        return false;
+    }
+    c.p += 2;
+    if (!cursor_match(&c, "GGA,") ||
+        !parse_time(&c, &f.time) || !cursor_skip(&c, ',') ||
+        !parse_coordinate(&c, 90, &f.latitude) || !cursor_skip(&c, ',') ||
+        !parse_hemisphere(&c, 'N', 'S', &f.latitude) || !cursor_skip(&c, ',') ||
+        !parse_coordinate(&c, 180, &f.longitude) || !cursor_skip(&c, ',') ||
+        !parse_hemisphere(&c, 'E', 'W', &f.longitude) || !cursor_skip(&c, ',') ||
+        !parse_uint(&c, 1, &quality) || !cursor_skip(&c, ',') ||
+        !parse_uint(&c, 2, &satellites) || !cursor_skip(&c, ',') || !skip_field(&c) ||
+        !parse_altitude(&c, &f.altitude) || quality == 0){
+        return false;
+    }
+    f.date = 0;
+    f.quality = quality;
+    f.satellites = satellites;
+    *fix = f;
+    return true;
+}
@@ -0,0 +1,54 @@
+/* MTSAS GPS sentence parsing
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTSAS_GPS_H
+#define MTSAS_GPS_H
+
+#include <stdint.h>
+
+/* The GPS parsers only depend on the C library so they can be built and
+ * exercised on a host, see test/
+ */
+
+/** GPS fix in fixed point form
+ */
+struct gps_fix {
+    int32_t latitude;                       // Micro-degrees, north is positive
+    int32_t longitude;                      // Micro-degrees, east is positive
+    int32_t altitude;                       // Centimetres above mean sea level
+    uint32_t time;                          // Milliseconds since midnight UTC
+    uint32_t date;                          // ddmmyy, 0 if not reported
+    uint8_t quality;                        // Fix indicator reported by the radio, never 0
+    uint8_t satellites;                     // Satellites in use
+};
+
+/** Parse a $GPSACP response into a fix
+ *  @param line  The response, with or without the "$GPSACP:" prefix
+ *  @param len   Length of the response
+ *  @param fix   Destination for the fix, untouched on failure
+ *  @return      true if the response holds a 2D or 3D fix
+ */
+bool gps_parse_acp(const char *line, unsigned len, gps_fix *fix);
+
+/** Parse an NMEA GGA sentence into a fix
+ *  @param line  The sentence, starting at the '$'
+ *  @param len   Length of the sentence
+ *  @param fix   Destination for the fix, untouched on failure
+ *  @return      true if the sentence holds a fix and its checksum, when present, matches
+ */
+bool gps_parse_gga(const char *line, unsigned len, gps_fix *fix);
+
+#endif
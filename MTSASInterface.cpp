@@ -30,72 +30,250 @@ enum registration_status {  NOT_REGISTERED = 0,
 #define MTSAS_MISC_TIMEOUT 3000
 #define MTSAS_RESTART_TIMEOUT 10000
 #define MTSAS_COMMUNICATION_TIMEOUT 100
+#define MTSAS_GPS_RETRY_INTERVAL 5000
+#define MTSAS_GPS_POLL_INTERVAL 500
+#define MTSAS_BAUD_SETTLE 20
+#define MTSAS_BAUD_CHECKS 3
+#define MTSAS_CMD_SIZE 80
+#define MTSAS_WAKE_TIMEOUT 2000
 
-MTSASInterface::MTSASInterface(PinName tx, PinName rx, bool debug)
-    : _serial(tx, rx, 1024), _parser(_serial)
+//Rates tried with the radio, highest first
+static const int mtsas_bauds[] = {921600, 460800, 230400, MTSAS_DEFAULT_BAUD};
+
+//Pre-encoded prefixes of the commands on the data path
+static const char cmd_scfg[] = "AT#SCFG=";
+static const char cmd_scfgext[] = "AT#SCFGEXT=";
+static const char cmd_sd[] = "AT#SD=";
+static const char cmd_sh[] = "AT#SH=";
+static const char cmd_ssendext[] = "AT#SSENDEXT=";
+static const char cmd_srecv[] = "AT#SRECV=";
+#define CMD(prefix) prefix, sizeof(prefix) - 1
+
+MTSASInterface::MTSASInterface(PinName tx, PinName rx, bool debug, PinName rts, PinName cts,
+    int buffer_size, int max_baud, PinName dtr)
+    : _serial(tx, rx, buffer_size), _parser(_serial)
 {
     _parser.debugOn(debug);
     // Register message indicating incoming data as out of band 
     // data (data that can come at any time)
     _parser.oob("SRING:",callback(this, &MTSASInterface::event));
-    _parser.setTimeout(MTSAS_MISC_TIMEOUT);
+#if MTSAS_HAS_HTTP
+    _parser.oob("#HTTPRING:",callback(this, &MTSASInterface::http_ring));
+#endif
+#if MTSAS_HAS_GPS
+    _parser.oob("$GPSNMUN:",callback(this, &MTSASInterface::gps_nmea));
+#endif
+#if MTSAS_HAS_SMS
+    _parser.oob("+CMT:",callback(this, &MTSASInterface::sms_cmt));
+#endif
+    set_timeout(MTSAS_MISC_TIMEOUT);
     _debug = debug;
-    _serial.baud(115200);
+    _baud = MTSAS_DEFAULT_BAUD;
+    _max_baud = max_baud;
+    _serial.baud(_baud);
+    _flow_control = false;
+#if DEVICE_SERIAL_FC
+    if (rts != NC && cts != NC){
+        _serial.set_flow_control(SerialBase::RTSCTS, rts, cts);
+        _flow_control = true;
+    }
+#endif
     // Serial RX will signal the event thread
     _serial.attach(callback(this, &MTSASInterface::rx_sem_release));
     event_thread.start(callback(this, &MTSASInterface::handle_event));
     memset(_socket_ids, 0 , sizeof(_socket_ids));
     memset(_cbs, 0, sizeof(_cbs));
+    memset(_sockets, 0, sizeof(_sockets));
+    memset(&_stats, 0, sizeof(_stats));
+    //DTR asserted (low) keeps the radio awake
+    _dtr = (dtr != NC) ? new DigitalOut(dtr, 0) : NULL;
+    _power_started = false;
+    _power_asleep = false;
+    _power_idle_time = 0;
+    _power_batch_window = 0;
+    _power_flush_pending = false;
+    _power_flush_at = 0;
+    _power_flush_retry = false;
+    _power_psm = false;
+    _power_edrx = false;
+    _power_psm_granted = false;
+    _power_edrx_granted = false;
+    _power_state = MTSAS_POWER_ACTIVE;
+    memset(_power_time, 0, sizeof(_power_time));
+    _power_wakeups = 0;
+    _power_wake_failures = 0;
+    _power_tx_bytes = 0;
+    _power_latency = 0;
+    _power_latency_max = 0;
+    _power_clock.start();
+    _power_since = _power_clock.read_ms();
+    _power_last_activity = _power_since;
+#if MTSAS_HAS_HTTP
+    _http_timeout = MTSAS_HTTP_TIMEOUT;
+    strcpy(_http_content_type, "application/octet-stream");
+#endif
+#if MTSAS_HAS_GPS
+    _gps_enabled = false;
+    _gps_started = false;
+    _gps_on_time = 0;
+    _gps_off_time = 0;
+    _gps_seq = 0;
+    _gps_clock.start();
+#endif
+#if MTSAS_HAS_SMS
+    _sms_cb = NULL;
+    _sms_msg_cb = NULL;
+    _sms_started = false;
+    memset(_sms_concat, 0, sizeof(_sms_concat));
+    _sms_received = 0;
+    _sms_queued = 0;
+    _sms_delivered = 0;
+    _sms_dropped = 0;
+    _sms_stamp = 0;
+#endif
     //PDP context
     context = 1;
 }
 
 MTSASInterface::~MTSASInterface(){
+    delete _dtr;
 }
 
 nsapi_error_t MTSASInterface::set_credentials(const char *apn,
     const char *username , const char *password)
 {
-    at_mutex.lock();
-    for (int i=1; i < MTSAS_SOCKET_COUNT; i++){
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    for (int i=1; i <= MTSAS_SOCKET_COUNT; i++){
         //Socket configuration 
         //AT#SCFG=<socket id>,<PDP context>,<packet size default 300>,
         //        <exchange timeout>,<connection to>,<txto>
-        _parser.send("AT#SCFG=%d,%d,0,0,600,0",i,context);
+        int args[] = {i, context};
+        send_cmd(CMD(cmd_scfg), args, 2, ",0,0,600,0");
+        _parser.recv("OK");
+        //AT#SCFGEXT=<socket id>,<SRING mode>,<receive data mode, text>,<keepalive, off>
+        int ext_args[] = {i, MTSAS_SRING_MODE};
+        send_cmd(CMD(cmd_scfgext), ext_args, 2, ",0,0");
         _parser.recv("OK");
     }
     //Activate the PDP context 
     int ret = NSAPI_ERROR_DEVICE_ERROR;
     if (_parser.send("AT+CGDCONT=%d,\"IP\",\"%s\"", context, apn) && _parser.recv("OK"))
         ret = 0;
-    at_mutex.unlock();
+    at_unlock();
     return ret;
 }
 
 nsapi_error_t MTSASInterface::init()
 {
-    _parser.setTimeout(MTSAS_RESTART_TIMEOUT);
+    //No wakeup, the reboot is what recovers a radio that does not answer
     at_mutex.lock();
+    if (_power_asleep){
+        _dtr->write(0);
+        _power_asleep = false;
+        power_account(MTSAS_POWER_ACTIVE);
+    }
+    //Get in step with the radio first, it keeps the negotiated rate when only the MCU is reset
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    if (!_parser.send("AT") || !_parser.recv("OK")){
+        sync_baud();
+    }
     //Reboot the chip
+    set_timeout(MTSAS_RESTART_TIMEOUT);
     _parser.send("AT#REBOOT");
     _parser.recv("OK");
-    _parser.setTimeout(MTSAS_MISC_TIMEOUT);
-    //Wait for response after reboot
-    for (int i = 0; i < 10; i++){
-        if (_parser.send("AT") && _parser.recv("OK")){
-            break;
-        }   
+    //The radio comes back awake with power saving disabled
+    _power_idle_time = 0;
+    _power_psm = false;
+    _power_edrx = false;
+    _power_psm_granted = false;
+    _power_edrx_granted = false;
+    //Wait for response after reboot, the radio is back at its stored rate
+    //so probe the known rates with the short timeout
+    Timer t;
+    t.start();
+    while (!sync_baud() && t.read_ms() < MTSAS_RESTART_TIMEOUT);
+    if (_flow_control){
+        //Hardware flow control on the radio's side
+        _parser.send("AT&K3");
+        _parser.recv("OK");
     }
+    negotiate_baud();
 
     //Device name
     _parser.send("AT+CGMM");
     _parser.recv("OK");
     _parser.send("AT+CGMM");
     _parser.recv("OK");
-    at_mutex.unlock();
+    at_unlock();
     return 0;
 }
 
+bool MTSASInterface::link_check()
+{
+    //Framing or echo errors show up as commands that are not acknowledged
+    for (int i = 0; i < MTSAS_BAUD_CHECKS; i++){
+        if (!_parser.send("AT") || !_parser.recv("OK")){
+            return false;
+        }
+    }
+    return true;
+}
+
+bool MTSASInterface::sync_baud()
+{
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    bool res = false;
+    for (unsigned i = 0; i < sizeof(mtsas_bauds) / sizeof(mtsas_bauds[0]) && !res; i++){
+        _baud = mtsas_bauds[i];
+        _serial.baud(_baud);
+        res = link_check();
+    }
+    set_timeout(MTSAS_MISC_TIMEOUT);
+    return res;
+}
+
+void MTSASInterface::negotiate_baud()
+{
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    for (unsigned i = 0; i < sizeof(mtsas_bauds) / sizeof(mtsas_bauds[0]); i++){
+        int baud = mtsas_bauds[i];
+        if (baud > _max_baud){
+            continue;
+        }
+        if (baud == _baud){
+            break;
+        }
+        //The radio acknowledges at the old rate then switches
+        int prev = _baud;
+        if (!_parser.send("AT+IPR=%d", baud) || !_parser.recv("OK")){
+            continue;
+        }
+        _serial.baud(baud);
+        Thread::wait(MTSAS_BAUD_SETTLE);
+        if (link_check()){
+            _baud = baud;
+            break;
+        }
+        //Step down, taking the radio back to the previous rate first
+        _parser.send("AT+IPR=%d", prev);
+        _parser.recv("OK");
+        _serial.baud(prev);
+        Thread::wait(MTSAS_BAUD_SETTLE);
+        if (!link_check()){
+            sync_baud();
+            set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+        }
+    }
+    set_timeout(MTSAS_MISC_TIMEOUT);
+}
+
+int MTSASInterface::get_baud()
+{
+    return _baud;
+}
+
 nsapi_error_t MTSASInterface::connect(const char *apn,
             const char *username, const char *password)
 {
@@ -106,7 +284,9 @@ bool MTSASInterface::registered()
 {
     //Get the network registation
     int stat = NOT_REGISTERED;
-    at_mutex.lock();    
+    if (!at_lock()){
+        return false;
+    }    
     _parser.send("AT+CREG?");
     _parser.recv("+CREG:%*d,%d", &stat);
     _parser.recv("OK"); 
@@ -116,7 +296,7 @@ bool MTSASInterface::registered()
         _parser.recv("+CREG:%*d,%d", &stat);
         _parser.recv("OK");
     }
-    at_mutex.unlock();
+    at_unlock();
     return (stat == REGISTERED || stat == ROAMING);
 }
 
@@ -124,7 +304,10 @@ bool MTSASInterface::set_ip_addr()
 {
     char* ip_buff = (char*)malloc(256);
     bool res = false; 
-    at_mutex.lock();  
+    if (!at_lock()){
+        free(ip_buff);
+        return false;
+    }
     //Try a few times to get an IP address 
     for (int i=0; i<5; i++){
         res  = _parser.send("AT#SGACT=%d,1", context) && 
@@ -133,7 +316,7 @@ bool MTSASInterface::set_ip_addr()
         if(res)
             break;
     } 
-    at_mutex.unlock();
+    at_unlock();
     res = res && _ip_address.set_ip_address(ip_buff);
     free(ip_buff);
     return res;
@@ -150,9 +333,11 @@ nsapi_error_t MTSASInterface::connect()
 nsapi_error_t MTSASInterface::disconnect() 
 {
     //Deactivate PDP context (frees any network resources associated with context)
-    at_mutex.lock();    
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }    
     int ret = (_parser.send("AT#SGACT=%d,0",context) && _parser.recv("OK")) ? 0 : NSAPI_ERROR_DEVICE_ERROR; 
-    at_mutex.unlock();
+    at_unlock();
     return ret;
 }
 
@@ -173,7 +358,10 @@ nsapi_error_t MTSASInterface::gethostbyname(const char* name, SocketAddress *add
 { 
     char* ip_buff = (char*)malloc(256);
     //Execute DNS query
-    at_mutex.lock();
+    if (!at_lock()){
+        free(ip_buff);
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
     int ret = 0;
     if (!_parser.send("AT#QDNS=%s",name) || !_parser.recv("#QDNS:%*[^,],\"%[^\"]\"%*[\r]%*[\n]", ip_buff) || !_parser.recv("OK")){
         ret = NSAPI_ERROR_DEVICE_ERROR;
@@ -181,7 +369,7 @@ nsapi_error_t MTSASInterface::gethostbyname(const char* name, SocketAddress *add
     else{
         address->set_ip_address(ip_buff);
     }
-    at_mutex.unlock();
+    at_unlock();
     free(ip_buff);
     return ret; 
 }
@@ -197,6 +385,8 @@ struct mtsas_socket {
     int port;
     int id;
     SocketAddress addr;
+    char *pending;                          // Sends held back while the link sleeps
+    unsigned pending_len;
 };
 
 int MTSASInterface::socket_open(void **handle, nsapi_protocol_t proto)
@@ -220,6 +410,9 @@ int MTSASInterface::socket_open(void **handle, nsapi_protocol_t proto)
     socket->port = 1;
     socket->proto = proto;
     socket->connected = false;
+    socket->pending = NULL;
+    socket->pending_len = 0;
+    _sockets[id-1] = socket;
     *handle = socket;
     return 0;
 }
@@ -228,16 +421,21 @@ int MTSASInterface::socket_close(void *handle)
 {
     struct mtsas_socket *socket = (struct mtsas_socket *)handle;
     //Issue socket close command
-    at_mutex.lock();
-    bool result = (_parser.send("AT#SH=%d",socket->id) && _parser.recv("OK"));   
-    at_mutex.unlock();
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    socket_flush(socket);
+    bool result = (send_cmd(CMD(cmd_sh), &socket->id, 1) && _parser.recv("OK"));   
+    _stats.commands++;
     if (result){
-        //Mark the socket not in use
+        //Mark the socket not in use, power_manager walks _sockets under the AT mutex
         _socket_ids[socket->id-1] = false;
+        _sockets[socket->id-1] = NULL;
+        free(socket->pending);
         delete socket;
-        return 0;
     }
-    return NSAPI_ERROR_DEVICE_ERROR;
+    at_unlock();
+    return result ? 0 : NSAPI_ERROR_DEVICE_ERROR;
 }
 
 int MTSASInterface::socket_bind(void *handle, const SocketAddress &address)
@@ -257,12 +455,17 @@ int MTSASInterface::socket_connect(void *handle, const SocketAddress &address)
         return 0;
     }
     uint16_t typeSocket = (socket->proto == NSAPI_UDP) ? 1 : 0;
-    at_mutex.lock();
-    //Socket dial SD=[socket id], [UDP or TCP], [Remote port], [Remote addr]
-    bool res =  (_parser.send("AT#SD=%d,%d,%d,\"%s\",0,1,1", socket->id, typeSocket, 
-                 address.get_port(), address.get_ip_address()) &&
-                _parser.recv("OK"));
-    at_mutex.unlock();
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //Socket dial SD=[socket id], [UDP or TCP], [Remote port], [Remote addr],
+    //               [closure type], [local port], [connection mode, 1 is command mode]
+    char suffix[sizeof(",\"\",0,1,1") + NSAPI_IPv6_SIZE];
+    sprintf(suffix, ",\"%s\",0,1,1", address.get_ip_address());
+    int args[] = {socket->id, typeSocket, address.get_port()};
+    bool res =  (send_cmd(CMD(cmd_sd), args, 3, suffix) && _parser.recv("OK"));
+    _stats.commands++;
+    at_unlock();
     if (res){
         socket->connected = true;
         return 0;
@@ -279,34 +482,79 @@ int MTSASInterface::socket_accept(nsapi_socket_t server,
 int MTSASInterface::socket_send(void *handle, const void *data, unsigned size)
 {
     struct mtsas_socket *socket = (struct mtsas_socket *)handle;   
-    int amnt_sent = -1;
-    //Issue send command SSENDEXT=[socket id], [# bytes to send]
-    at_mutex.lock();
-    _parser.setTimeout(MTSAS_COMMUNICATION_TIMEOUT);
-    if(_parser.send("AT#SSENDEXT=%d,%d",socket->id, size)){
-        //OK to write message
-        _parser.recv("> ");
-        amnt_sent = _parser.write((char *)data, (int)size);
-        _parser.recv("OK");
+    //Larger TCP sends are split by the caller, a datagram cannot be
+    if (size > MTSAS_SEND_MAX){
+        if (socket->proto == NSAPI_UDP){
+            return NSAPI_ERROR_PARAMETER;
+        }
+        size = MTSAS_SEND_MAX;
     }
+    //Hold the data back if the link sleeps and sends are batched
+    at_mutex.lock();
+    bool batched = _power_asleep && _power_batch_window && socket_batch(socket, data, size);
     at_mutex.unlock();
+    if (batched){
+        return size;
+    }
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //Data held back earlier goes first, nothing is sent past what could not be
+    int amnt_sent = socket_flush(socket) ? send_data(socket, data, size) : NSAPI_ERROR_DEVICE_ERROR;
+    at_unlock();
     return amnt_sent;
 }
 
+int MTSASInterface::send_data(struct mtsas_socket *socket, const void *data, unsigned size)
+{
+    //Issue send command SSENDEXT=[socket id], [# bytes to send]
+    int args[] = {socket->id, (int)size};
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    //The data only counts as sent once the radio has prompted for it and acknowledged it
+    bool res = send_cmd(CMD(cmd_ssendext), args, 2) && _parser.recv("> ") &&
+               _parser.write((char *)data, (int)size) == (int)size && _parser.recv("OK");
+    _stats.commands++;
+    if (!res){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    _stats.tx_bytes += size;
+    _power_tx_bytes += size;
+    return size;
+}
+
 int MTSASInterface::socket_recv(void *handle, void *data, unsigned size)
 {
     struct mtsas_socket *socket = (struct mtsas_socket *)handle;   
     int amnt_rcv = -1;
     //Paramater size is desired # bytes, recv_size is bytes actually on socket
     int recv_size = 0;
-    at_mutex.lock();
-    _parser.setTimeout(MTSAS_COMMUNICATION_TIMEOUT);
+    int recv_id = 0;
+    if (size > MTSAS_RECV_MAX){
+        size = MTSAS_RECV_MAX;
+    }
+    int args[] = {socket->id, (int)size};
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
     //Issue send command SRECV=[socket id], [# bytes to recv]
-    if(_parser.send("AT#SRECV=%d,%d",socket->id, size) && _parser.recv("#SRECV:%d,%d%*[\r]%*[\n]", socket->id, &recv_size)){
-        amnt_rcv = _parser.read((char *)data, (int)recv_size);
+    //Response is #SRECV: [socket id],[# bytes]<CR><LF>[data]
+    if(send_cmd(CMD(cmd_srecv), args, 2) && _parser.recv("#SRECV:") &&
+       read_int(&recv_id) == ',' && read_int(&recv_size) == '\r' && _parser.getc() == '\n'){
+        if (recv_id == socket->id && recv_size <= (int)size){
+            amnt_rcv = _parser.read((char *)data, recv_size);
+        }
+        else{
+            //Not the data asked for, drop it so the parser stays in step
+            for (int i = 0; i < recv_size && _parser.getc() >= 0; i++);
+        }
         _parser.recv("OK");
     }
-    at_mutex.unlock();
+    _stats.commands++;
+    if (amnt_rcv > 0){
+        _stats.rx_bytes += amnt_rcv;
+    }
+    at_unlock();
     if (amnt_rcv == -1 || amnt_rcv == 0) {
         return NSAPI_ERROR_WOULD_BLOCK;
     }
@@ -343,6 +591,52 @@ int MTSASInterface::socket_recvfrom(void *handle, SocketAddress *address, void *
     return ret;
 }
 
+bool MTSASInterface::socket_batch(struct mtsas_socket *socket, const void *data, unsigned size)
+{
+    //Called with the AT mutex held
+    //Datagrams are held with their length in front so each goes out on its own
+    unsigned header = (socket->proto == NSAPI_UDP) ? 2 : 0;
+    if (!socket->pending){
+        socket->pending = (char *)malloc(MTSAS_SEND_MAX);
+    }
+    if (!socket->pending || socket->pending_len + header + size > MTSAS_SEND_MAX){
+        return false;
+    }
+    char *p = socket->pending + socket->pending_len;
+    if (header){
+        *p++ = size >> 8;
+        *p++ = size & 0xFF;
+    }
+    memcpy(p, data, size);
+    socket->pending_len += header + size;
+    if (!_power_flush_pending){
+        //The first send held back opens the batch window
+        _power_flush_pending = true;
+        _power_flush_retry = false;
+        _power_flush_at = _power_clock.read_ms() + _power_batch_window;
+        _power_sem.release();
+    }
+    return true;
+}
+
+bool MTSASInterface::socket_flush(struct mtsas_socket *socket)
+{
+    //Called with the AT mutex held and the link awake
+    //TCP data goes out in one #SSENDEXT, datagrams one at a time
+    unsigned header = (socket->proto == NSAPI_UDP) ? 2 : 0;
+    while (socket->pending_len){
+        const uint8_t *p = (const uint8_t *)socket->pending;
+        unsigned size = header ? (p[0] << 8) | p[1] : socket->pending_len;
+        if (send_data(socket, p + header, size) < 0){
+            //Keep what the radio did not take for the next flush
+            return false;
+        }
+        socket->pending_len -= header + size;
+        memmove(socket->pending, socket->pending + header + size, socket->pending_len);
+    }
+    return true;
+}
+
 void MTSASInterface::socket_attach(void *handle, void (*callback)(void *), void *data)
 {
     struct mtsas_socket *socket = (struct mtsas_socket *)handle;   
@@ -360,10 +654,10 @@ void MTSASInterface::handle_event(){
         rx_sem.wait();
         //Unlock the mutex controlling AT command execution
         at_mutex.lock();
-        _parser.setTimeout(0);
+        set_timeout(0);
         //Check for SRING incoming data
         bool res = (_parser.recv("SRING:%*d"));       
-        _parser.setTimeout(MTSAS_MISC_TIMEOUT);
+        set_timeout(MTSAS_MISC_TIMEOUT);
         at_mutex.unlock();
         if(res){
             //Raise an event if the socket has data
@@ -380,83 +674,673 @@ void MTSASInterface::event() {
     }
 }
 
+//Append the decimal representation of value
+static char *append_int(char *p, int value){
+    char digits[10];
+    int n = 0;
+    unsigned v = (value < 0) ? -(unsigned)value : (unsigned)value;
+    if (value < 0){
+        *p++ = '-';
+    }
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    while (n){
+        *p++ = digits[--n];
+    }
+    return p;
+}
+
+bool MTSASInterface::send_cmd(const char *prefix, unsigned prefix_len, const int *args, int count,
+    const char *suffix){
+    //<prefix><arg>,<arg>,...<suffix>\r\n
+    char cmd[MTSAS_CMD_SIZE];
+    memcpy(cmd, prefix, prefix_len);
+    char *p = cmd + prefix_len;
+    for (int i = 0; i < count; i++){
+        if (i){
+            *p++ = ',';
+        }
+        p = append_int(p, args[i]);
+    }
+    if (suffix){
+        int n = strlen(suffix);
+        MBED_ASSERT(p + n + 2 <= cmd + sizeof(cmd));
+        memcpy(p, suffix, n);
+        p += n;
+    }
+    if (_debug){
+        printf("AT> %.*s\r\n", (int)(p - cmd), cmd);
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    return _parser.write(cmd, p - cmd) == p - cmd;
+}
+
+int MTSASInterface::read_int(int *value){
+    int c;
+    int v = 0;
+    while ((c = _parser.getc()) == ' ');
+    for (; c >= '0' && c <= '9'; c = _parser.getc()){
+        v = v * 10 + (c - '0');
+    }
+    *value = v;
+    //The character that ended the number
+    return c;
+}
+
+void MTSASInterface::set_timeout(int timeout){
+    _timeout = timeout;
+    _parser.setTimeout(timeout);
+}
+
+int MTSASInterface::read_line(char *line, int size){
+    //Called from an out of band handler with the AT mutex already held
+    int len = 0;
+    int c;
+    //The recv interrupted by the handler resumes with its own timeout
+    int timeout = _timeout;
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    //Skip the line feed left over from the previous line
+    while ((c = _parser.getc()) == '\n');
+    for (; c >= 0 && c != '\r' && c != '\n'; c = _parser.getc()){
+        //Drop what does not fit in the buffer
+        if (len < size - 1){
+            line[len++] = c;
+        }
+    }
+    set_timeout(timeout);
+    line[len] = '\0';
+    return (c < 0) ? -1 : len;
+}
+
+////////////////////////////////////////////////////////////////////////
+//Power management methods
+////////////////////////////////////////////////////////////////////////
+bool MTSASInterface::at_lock(){
+    at_mutex.lock();
+    //Wake the link for the command about to be issued
+    if (_power_asleep && !power_wake()){
+        at_mutex.unlock();
+        return false;
+    }
+    return true;
+}
+
+void MTSASInterface::at_unlock(){
+    _power_last_activity = _power_clock.read_ms();
+    at_mutex.unlock();
+}
+
+void MTSASInterface::power_account(mtsas_power_state state){
+    int now = _power_clock.read_ms();
+    _power_time[_power_state] += now - _power_since;
+    _power_since = now;
+    _power_state = state;
+}
+
+#if MTSAS_HAS_PSM
+//Whether a +CEREG: 4 response carries an Active-Time, PSM is granted unless
+//it is missing or deactivated (unit bits 111)
+static bool cereg_psm_granted(const char *line){
+    //<n>,<stat>,[<tac>],[<ci>],[<AcT>],[<cause type>],[<reject cause>],[<Active-Time>],[<Periodic-TAU>]
+    for (int field = 0; field < 7; field++){
+        line = strchr(line, ',');
+        if (!line){
+            return false;
+        }
+        line++;
+    }
+    if (*line == '"'){
+        line++;
+    }
+    for (int i = 0; i < 8; i++){
+        if (line[i] != '0' && line[i] != '1'){
+            return false;
+        }
+    }
+    return strncmp(line, "111", 3) != 0;
+}
+#endif
+
+void MTSASInterface::power_read_grant(){
+    //Called with the AT mutex held and the link awake
+    //The network may refuse or drop the requested modes, only granted ones count
+#if MTSAS_HAS_PSM
+    char line[96];
+    _power_psm_granted = false;
+    if (_power_psm && _parser.send("AT+CEREG=4") && _parser.recv("OK")){
+        if (_parser.send("AT+CEREG?") && _parser.recv("+CEREG:")){
+            int len = read_line(line, sizeof(line));
+            _power_psm_granted = len > 0 && cereg_psm_granted(line);
+            _parser.recv("OK");
+        }
+        //Back to no registration reports
+        _parser.send("AT+CEREG=0");
+        _parser.recv("OK");
+    }
+    //+CEDRXRDP: <AcT type>,... where an AcT type of 0 means eDRX is not used
+    int act = 0;
+    _power_edrx_granted = _power_edrx && _parser.send("AT+CEDRXRDP") &&
+                          _parser.recv("+CEDRXRDP: %d", &act) && _parser.recv("OK") && act != 0;
+#endif
+}
+
+void MTSASInterface::power_enter_sleep(){
+    power_read_grant();
+    //With AT+CFUN=5 the radio sleeps while DTR is deasserted
+    _dtr->write(1);
+    _power_asleep = true;
+    power_account(_power_psm_granted ? MTSAS_POWER_PSM : _power_edrx_granted ? MTSAS_POWER_EDRX : MTSAS_POWER_SLEEP);
+}
+
+bool MTSASInterface::power_wake(){
+    Timer t;
+    t.start();
+    _dtr->write(0);
+    //The radio answers once it is awake
+    int timeout = _timeout;
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    bool res;
+    while (!(res = _parser.send("AT") && _parser.recv("OK")) && t.read_ms() < MTSAS_WAKE_TIMEOUT);
+    set_timeout(timeout);
+    if (!res){
+        //Still asleep as far as we know, the next command tries again
+        _dtr->write(1);
+        _power_wake_failures++;
+        return false;
+    }
+    _power_asleep = false;
+    power_account(MTSAS_POWER_ACTIVE);
+    _power_wakeups++;
+    _power_latency = t.read_ms();
+    if (_power_latency > _power_latency_max){
+        _power_latency_max = _power_latency;
+    }
+    return true;
+}
+
+void MTSASInterface::power_manager(){
+    while(true){
+        uint32_t delay = osWaitForever;
+        at_mutex.lock();
+        int now = _power_clock.read_ms();
+        if (_power_flush_pending){
+            if ((!_power_asleep && !_power_flush_retry) || now - _power_flush_at >= 0){
+                //End of the batch window, send everything held back in one wakeup
+                bool flushed = !_power_asleep || power_wake();
+                for (int i = 0; flushed && i < MTSAS_SOCKET_COUNT; i++){
+                    if (_sockets[i]){
+                        flushed = socket_flush(_sockets[i]);
+                    }
+                }
+                now = _power_clock.read_ms();
+                if (!_power_asleep){
+                    _power_last_activity = now;
+                }
+                //Try again after another batch window if the radio did not take it all
+                _power_flush_pending = !flushed;
+                _power_flush_retry = !flushed;
+                _power_flush_at = now + (_power_batch_window ? _power_batch_window : MTSAS_WAKE_TIMEOUT);
+            }
+            if (_power_flush_pending){
+                delay = _power_flush_at - now;
+            }
+        }
+        if (!_power_asleep && _power_idle_time){
+            int idle = now - _power_last_activity;
+            if (idle >= (int)_power_idle_time){
+                power_enter_sleep();
+            }
+            else if ((uint32_t)(_power_idle_time - idle) < delay){
+                delay = _power_idle_time - idle;
+            }
+        }
+        at_mutex.unlock();
+        //Wait for the next deadline or a new configuration
+        _power_sem.wait(delay);
+    }
+}
+
+nsapi_error_t MTSASInterface::power_sleep(unsigned idle_time, unsigned batch_window){
+    if (!_dtr){
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //AT+CFUN=5 lets DTR control the radio's sleep, AT+CFUN=1 keeps it awake
+    bool res = _parser.send("AT+CFUN=%d", idle_time ? 5 : 1) && _parser.recv("OK");
+    if (res){
+        _power_idle_time = idle_time;
+        _power_batch_window = batch_window;
+    }
+    at_unlock();
+    if (!res){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!_power_started){
+        if (power_thread.start(callback(this, &MTSASInterface::power_manager)) != osOK){
+            return NSAPI_ERROR_NO_MEMORY;
+        }
+        _power_started = true;
+    }
+    _power_sem.release();
+    return 0;
+}
+
+#if MTSAS_HAS_PSM
+nsapi_error_t MTSASInterface::power_psm(bool enable, const char *periodic_tau, const char *active_time){
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //AT+CPSMS=<mode>,<periodic RAU>,<GPRS ready timer>,<periodic TAU>,<active time>
+    bool res = (enable ? _parser.send("AT+CPSMS=1,,,\"%s\",\"%s\"", periodic_tau, active_time) :
+                         _parser.send("AT+CPSMS=0")) &&
+               _parser.recv("OK");
+    if (res){
+        _power_psm = enable;
+    }
+    at_unlock();
+    return res ? 0 : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+nsapi_error_t MTSASInterface::power_edrx(bool enable, const char *cycle){
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //AT+CEDRXS=<mode>,<access technology, 4 is E-UTRAN>,<eDRX cycle>
+    bool res = (enable ? _parser.send("AT+CEDRXS=1,4,\"%s\"", cycle) :
+                         _parser.send("AT+CEDRXS=0")) &&
+               _parser.recv("OK");
+    if (res){
+        _power_edrx = enable;
+    }
+    at_unlock();
+    return res ? 0 : NSAPI_ERROR_DEVICE_ERROR;
+}
+#endif
+
+void MTSASInterface::power_get_stats(mtsas_power_stats *stats){
+    static const unsigned current_ua[MTSAS_POWER_STATES] = {
+        MTSAS_ACTIVE_UA, MTSAS_SLEEP_UA, MTSAS_EDRX_UA, MTSAS_PSM_UA};
+    at_mutex.lock();
+    //Bring the time in the current state up to date
+    power_account(_power_state);
+    uint64_t energy_uj = 0;
+    for (int i = 0; i < MTSAS_POWER_STATES; i++){
+        stats->time_ms[i] = _power_time[i];
+        energy_uj += (uint64_t)_power_time[i] * current_ua[i] * MTSAS_SUPPLY_MV / 1000000;
+    }
+    stats->wakeups = _power_wakeups;
+    stats->wake_latency_ms = _power_latency;
+    stats->wake_latency_max_ms = _power_latency_max;
+    stats->wake_failures = _power_wake_failures;
+    stats->energy_mj = energy_uj / 1000;
+    stats->uj_per_kb = _power_tx_bytes ? energy_uj * 1024 / _power_tx_bytes : 0;
+    at_mutex.unlock();
+}
+
 ////////////////////////////////////////////////////////////////////////
 //Cell module methods
 ////////////////////////////////////////////////////////////////////////
 void MTSASInterface::get_imei(char* imei){
-    at_mutex.lock();
+    if (!at_lock()){
+        return;
+    }
     _parser.send("AT#CGSN");
     _parser.recv("#CGSN: %s%*[\r]%*[\n]", imei);
-    at_mutex.unlock();
+    at_unlock();
 }
 
+#if MTSAS_HAS_SMS
 void MTSASInterface::sms_attach(void (*callback)(char*)){
     _sms_cb = callback;
     sms_listen();
 } 
 
-void MTSASInterface::sms_rx_sem_release(){  
-    sms_rx_sem.release();
+void MTSASInterface::sms_attach(void (*callback)(sms_message *)){
+    _sms_msg_cb = callback;
+    sms_listen();
+}
+
+void MTSASInterface::sms_get_stats(sms_stats *stats){
+    stats->received = _sms_received;
+    stats->delivered = _sms_delivered;
+    stats->dropped = _sms_dropped;
+    stats->backlog = _sms_queued - _sms_delivered;
 }
 
 void MTSASInterface::sms_listen(){
-    at_mutex.lock();
-    //Receive texts in text mode (unencoded)
-    _parser.send("AT+CMGF=1");
-    _parser.recv("OK");
-    //Show all values in result codes
-    _parser.send("AT+CSDH=1");
+    if (!at_lock()){
+        return;
+    }
+    //Receive texts in PDU mode (binary safe)
+    _parser.send("AT+CMGF=0");
     _parser.recv("OK");
     //Specify the buffering of unsolicited text notifications to go to TA
     //and also that the text message be displayed with the notification
     _parser.send("AT+CNMI=2,2");    
     _parser.recv("OK");
-    at_mutex.unlock();
-    //Signal thread when there is a serial rx
-    _serial.attach(callback(this, &MTSASInterface::sms_rx_sem_release));
-    sms_event_thread.start(callback(this, &MTSASInterface::handle_sms_event));
+    at_unlock();
+    //Incoming +CMT are handled as out of band data, the worker
+    //thread only hands queued messages to the callback
+    if (!_sms_started){
+        _sms_started = true;
+        sms_event_thread.start(callback(this, &MTSASInterface::handle_sms_event));
+    }
 }
 
 void MTSASInterface::handle_sms_event(){
     while(true){
-        //Wait for signal from serial RX
-        sms_rx_sem.wait();
-        //Unlock the mutex controlling AT command execution
-        at_mutex.lock();
-        _parser.setTimeout(0);
-        //Check for +CMT incoming message
-        char msg[256];
-        int length;
-        //Parse notification for the length of the message
-        //TODO: Parse and handle phone number, timestamp, etc
-        bool res = _parser.recv("+CMT: %*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%d%*[\r]%*[\n]", &length);
-        if(res){
-            //Max message 256
-            if(length > 256){
-                length = 255;
+        //Wait for a complete message
+        osEvent evt = _sms_queue.get();
+        if (evt.status != osEventMail){
+            continue;
+        }
+        sms_message *msg = (sms_message *)evt.value.p;
+        if (_sms_msg_cb){
+            _sms_msg_cb(msg);
+        }
+        else if (_sms_cb){
+            _sms_cb(msg->data);
+        }
+        _sms_queue.free(msg);
+        _sms_delivered++;
+    }
+}
+
+void MTSASInterface::sms_cmt(){
+    //+CMT: [<alpha>],<length><CR><LF><pdu>
+    //Called from the parser with the AT mutex already held
+    _sms_received++;
+    int len = read_line(_sms_line, sizeof(_sms_line));
+    const char *comma = (len < 0) ? NULL : strrchr(_sms_line, ',');
+    int length = comma ? atoi(comma + 1) : -1;
+    len = (length > 0) ? read_line(_sms_line, sizeof(_sms_line)) : -1;
+    len = (len > 0) ? sms_hex_decode(_sms_line, len) : -1;
+    sms_pdu pdu;
+    //The length counts the PDU without the service centre address
+    if (len <= 0 || len != 1 + (uint8_t)_sms_line[0] + length ||
+        !sms_parse_pdu((const uint8_t *)_sms_line, len, &pdu)){
+        _sms_dropped++;
+        return;
+    }
+    sms_store(&pdu);
+}
+
+void MTSASInterface::sms_store(sms_pdu *pdu){
+    if (pdu->total == 1){
+        sms_message *msg = _sms_queue.alloc();
+        if (!msg){
+            _sms_dropped++;
+            return;
+        }
+        strcpy(msg->sender, pdu->sender);
+        strcpy(msg->timestamp, pdu->timestamp);
+        msg->encoding = pdu->encoding;
+        msg->length = sms_decode_ud(pdu, msg->data, MTSAS_SMS_MAX_LENGTH);
+        msg->data[msg->length] = '\0';
+        _sms_queue.put(msg);
+        _sms_queued++;
+        return;
+    }
+    //Parts past the ones we keep are dropped, the message is delivered without them
+    if (pdu->seq > MTSAS_SMS_MAX_PARTS){
+        _sms_dropped++;
+        return;
+    }
+    //Find the message this part belongs to, or a slot to reassemble it in
+    int slot = -1;
+    int oldest = 0;
+    for (int i = 0; i < MTSAS_SMS_CONCAT_SLOTS; i++){
+        if (_sms_concat[i].msg && _sms_concat[i].ref == pdu->ref &&
+            strcmp(_sms_concat[i].msg->sender, pdu->sender) == 0){
+            slot = i;
+            break;
+        }
+        if (slot < 0 && !_sms_concat[i].msg){
+            slot = i;
+        }
+        if (_sms_concat[i].stamp < _sms_concat[oldest].stamp){
+            oldest = i;
+        }
+    }
+    if (slot < 0){
+        //Evict the incomplete message we heard from longest ago
+        slot = oldest;
+        _sms_queue.free(_sms_concat[slot].msg);
+        _sms_concat[slot].msg = NULL;
+        _sms_dropped++;
+    }
+    if (!_sms_concat[slot].msg){
+        sms_message *msg = _sms_queue.alloc();
+        if (!msg){
+            _sms_dropped++;
+            return;
+        }
+        strcpy(msg->sender, pdu->sender);
+        strcpy(msg->timestamp, pdu->timestamp);
+        msg->encoding = pdu->encoding;
+        _sms_concat[slot].msg = msg;
+        _sms_concat[slot].ref = pdu->ref;
+        _sms_concat[slot].total = (pdu->total < MTSAS_SMS_MAX_PARTS) ? pdu->total : MTSAS_SMS_MAX_PARTS;
+        _sms_concat[slot].received = 0;
+    }
+    _sms_concat[slot].stamp = ++_sms_stamp;
+    sms_message *msg = _sms_concat[slot].msg;
+    int part = pdu->seq - 1;
+    //Parts are stored at fixed offsets until the message is complete
+    _sms_concat[slot].part_len[part] = sms_decode_ud(pdu, msg->data + part * MTSAS_SMS_PART_SIZE, MTSAS_SMS_PART_SIZE);
+    _sms_concat[slot].received |= 1UL << part;
+    if (_sms_concat[slot].received != (1UL << _sms_concat[slot].total) - 1){
+        return;
+    }
+    //Pack the parts together
+    int length = 0;
+    for (int i = 0; i < _sms_concat[slot].total; i++){
+        memmove(msg->data + length, msg->data + i * MTSAS_SMS_PART_SIZE, _sms_concat[slot].part_len[i]);
+        length += _sms_concat[slot].part_len[i];
+    }
+    msg->length = length;
+    msg->data[length] = '\0';
+    _sms_concat[slot].msg = NULL;
+    _sms_queue.put(msg);
+    _sms_queued++;
+}
+#endif
+
+#if MTSAS_HAS_HTTP
+////////////////////////////////////////////////////////////////////////
+//HTTP client methods
+////////////////////////////////////////////////////////////////////////
+nsapi_error_t MTSASInterface::http_config(const char *host, int port, bool ssl,
+    int timeout, const char *content_type)
+{
+    //Not while a request uses the profile
+    _http_mutex.lock();
+    if (!at_lock()){
+        _http_mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    //HTTP client configuration
+    //AT#HTTPCFG=<profile id>,<server address>,<server port>,<auth type>,
+    //           <username>,<password>,<ssl enabled>,<timeout>,<PDP context>
+    bool res = _parser.send("AT#HTTPCFG=%d,\"%s\",%d,0,\"\",\"\",%d,%d,%d", MTSAS_HTTP_PROFILE,
+                            host, port, ssl ? 1 : 0, timeout, context) &&
+               _parser.recv("OK");
+    if (res){
+        _http_timeout = timeout;
+        strncpy(_http_content_type, content_type, sizeof(_http_content_type) - 1);
+        _http_content_type[sizeof(_http_content_type) - 1] = '\0';
+    }
+    at_unlock();
+    _http_mutex.unlock();
+    return res ? 0 : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+void MTSASInterface::http_ring()
+{
+    //#HTTPRING: <profile id>,<status code>,<content type>,<data size>
+    //Called from the parser with the AT mutex already held
+    int timeout = _timeout;
+    set_timeout(MTSAS_COMMUNICATION_TIMEOUT);
+    int profile;
+    int c = (read_int(&profile) == ',') ? read_int(&_http_status) : -1;
+    //The content type may be empty or hold commas, the data size follows the last comma
+    int size = -1;
+    while (c == ','){
+        c = read_int(&size);
+        while (c >= 0 && c != ',' && c != '\r'){
+            size = -1;
+            c = _parser.getc();
+        }
+    }
+    if (c == '\r'){
+        _parser.getc();
+    }
+    set_timeout(timeout);
+    //Wake the request even if the line is malformed so it fails now rather than at its timeout
+    _http_size = (c == '\r') ? size : -1;
+    _http_sem.release();
+}
+
+struct mtsas_http_buffer {
+    char *data;
+    unsigned size;
+    unsigned len;
+};
+
+static void http_buffer_write(void *handle, const char *chunk, unsigned size)
+{
+    struct mtsas_http_buffer *buffer = (struct mtsas_http_buffer *)handle;
+    //Discard what does not fit in the caller's buffer
+    if (size > buffer->size - buffer->len){
+        size = buffer->size - buffer->len;
+    }
+    memcpy(buffer->data + buffer->len, chunk, size);
+    buffer->len += size;
+}
+
+int MTSASInterface::http_request(mtsas_http_method method, const char *resource,
+    const void *body, unsigned body_size, void *buffer, unsigned size, int *status)
+{
+    struct mtsas_http_buffer response = {(char *)buffer, size, 0};
+    int ret = http_request(method, resource, body, body_size, &http_buffer_write, &response, status);
+    return (ret < 0) ? ret : (int)response.len;
+}
+
+int MTSASInterface::http_request(mtsas_http_method method, const char *resource,
+    const void *body, unsigned body_size,
+    void (*callback)(void *, const char *, unsigned), void *data, int *status)
+{
+    //One request at a time, #HTTPRING does not say which request it answers
+    _http_mutex.lock();
+    int ret = http_exchange(method, resource, body, body_size, callback, data, status);
+    _http_mutex.unlock();
+    return ret;
+}
+
+int MTSASInterface::http_exchange(mtsas_http_method method, const char *resource,
+    const void *body, unsigned body_size,
+    void (*callback)(void *, const char *, unsigned), void *data, int *status)
+{
+    Timer t;
+    t.start();
+    //Drop notifications left behind by an abandoned request
+    while (_http_sem.wait(0) > 0);
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    set_timeout(MTSAS_MISC_TIMEOUT);
+    bool res;
+    if (method == MTSAS_HTTP_POST || method == MTSAS_HTTP_PUT){
+        //Issue send command HTTPSND=[profile id], [POST or PUT], [resource], [# bytes], [content type]
+        res = _parser.send("AT#HTTPSND=%d,%d,\"%s\",%d,\"%s\"", MTSAS_HTTP_PROFILE,
+                           method - MTSAS_HTTP_POST, resource, body_size, _http_content_type) &&
+              _parser.recv(">>>") &&
+              _parser.write((char *)body, (int)body_size) == (int)body_size &&
+              _parser.recv("OK");
+        _stats.tx_bytes += res ? body_size : 0;
+        _power_tx_bytes += res ? body_size : 0;
+    }
+    else{
+        //Issue query command HTTPQRY=[profile id], [GET, HEAD or DELETE], [resource]
+        res = _parser.send("AT#HTTPQRY=%d,%d,\"%s\"", MTSAS_HTTP_PROFILE, method, resource) &&
+              _parser.recv("OK");
+    }
+    _stats.commands++;
+    at_unlock();
+    //The radio raises #HTTPRING once the server has responded
+    if (!res || _http_sem.wait(_http_timeout * 1000 + MTSAS_MISC_TIMEOUT) <= 0 || _http_size < 0){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (!at_lock()){
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (status){
+        *status = _http_status;
+    }
+    int total = _http_size;
+    int amnt_rcv = 0;
+    if (total > 0){
+        //Read the response body, it follows the <<< prompt
+        res = _parser.send("AT#HTTPRCV=%d", MTSAS_HTTP_PROFILE) && _parser.recv("<<<");
+        while (res && amnt_rcv < total){
+            int chunk = (total - amnt_rcv < MTSAS_HTTP_CHUNK_SIZE) ? total - amnt_rcv : MTSAS_HTTP_CHUNK_SIZE;
+            res = (_parser.read(_http_chunk, chunk) == chunk);
+            if (res){
+                callback(data, _http_chunk, chunk);
+                amnt_rcv += chunk;
             }
-            //Read the message
-            _parser.read(msg, length);
-            _parser.setTimeout(MTSAS_MISC_TIMEOUT);
-            at_mutex.unlock();
-            msg[length]='\0';
-            //Raise an event if the socket has data
-            _sms_cb(msg);
         }
+        res = res && _parser.recv("OK");
+        _stats.commands++;
+        _stats.rx_bytes += amnt_rcv;
+    }
+    if (res){
+        _stats.http_requests++;
+        _stats.http_latency_ms = t.read_ms();
     }
+    at_unlock();
+    return res ? total : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+#endif
+
+void MTSASInterface::get_link_stats(mtsas_link_stats *stats)
+{
+    at_mutex.lock();
+    *stats = _stats;
+    stats->serial_tx_bytes = _serial.tx_bytes;
+    stats->serial_rx_bytes = _serial.rx_bytes;
+    at_mutex.unlock();
+}
+
+void MTSASInterface::reset_link_stats()
+{
+    at_mutex.lock();
+    memset(&_stats, 0, sizeof(_stats));
+    _serial.tx_bytes = 0;
+    _serial.rx_bytes = 0;
+    at_mutex.unlock();
 }
 
+#if MTSAS_HAS_GPS
 ////////////////////////////////////////////////////////////////////////
 //GPS module methods
 ////////////////////////////////////////////////////////////////////////
 int MTSASInterface::get_gps_state(){
     int state;
-    at_mutex.lock();
+    if (!at_lock()){
+        return -1;
+    }
     //Query the gps status
     _parser.send("AT$GPSP?");
     _parser.recv("$GPSP: %d", &state);
     _parser.recv("OK");
-    at_mutex.unlock();
+    at_unlock();
     return state;
 }
 
@@ -464,103 +1348,198 @@ bool MTSASInterface::set_gps_state(int state){
     bool res = true;
     //Check if the gos is already in the requested state
     if(get_gps_state() != state){
-        at_mutex.lock();
+        if (!at_lock()){
+            return false;
+        }
         //Set gps state
         res = _parser.send("AT$GPSP=%d", state) && _parser.recv("OK");
-        at_mutex.unlock();
+        at_unlock();
     }
     return res;
 }
 
-int find_dir(char* coord){
-    int i = 0;
-    //Look for the cardinal direction in the coordinate
-    while (coord[i] != 'W' && coord[i] != 'N' && coord[i] != 'S' && coord[i] != 'E'){
-        i++;
-    }
-    char dir = coord[i];
-    /**
-    According to ISO 6709:
-        North latitude is positive
-        East longitude is positive
-    **/
-    return (dir == 'W' || dir == 'S') ? -1 : 1;
-}
-
-void format_data(gps_data* data){
-    /**
-    Response from the radio is:
-    <latitude> - format is ddmm.mmmm N/S (referred to GGA sentence)
-    where:
-    dd - degrees
-    00..90
-    mm.mmmm - minutes
-    00.0000..59.9999
-    N/S: North / South
-    <longitude> - format is dddmm.mmmm E/W (referred to GGA sentence)
-    where:
-    ddd - degrees
-    000..180
-    mm.mmmm - minutes
-    00.0000..59.9999
-    E/W: East / West
-    
-
-    This function converts this to ISO 6709 GPS standard
-    **/
-    char lat_deg[2];
-    char long_deg[3];
-    char lat_min[6];
-    char long_min[6];
-    strncpy(lat_deg, data->latitude, 2);
-    strncpy(long_deg, data->longitude, 3);
-    strncpy(lat_min, data->latitude+2, 6);
-    strncpy(long_min, data->longitude+3, 6);
-    //Find the cardinal direction of the coordinate
-    int lat_dir = find_dir(data->latitude);
-    int long_dir = find_dir(data->longitude);
-    memset(&data->longitude[0], 0, sizeof(data->longitude));
-    memset(&data->latitude[0], 0, sizeof(data->latitude));
-    //Convert string values to floats and compute ISO 6709 GPS coordinates
-    float lat = lat_dir * (std::atof(lat_deg) + std::atof(lat_min)/60);
-    float lon = long_dir * (std::atof(long_deg) + std::atof(long_min)/60);
-    sprintf(data->latitude, "%f", lat);
-    sprintf(data->longitude, "%f", lon);
-}
-    
-gps_data MTSASInterface::get_gps_location(const char* lat_default, const char* lon_default){
-    //enable GPS
-    set_gps_state(1); 
-    struct gps_data data = {"None", "None", "None", "None"};
-    //Start querying location
-    bool res = _parser.send("AT$GPSACP") && _parser.recv("OK");
-    if (!res){
-        //Return immediately if we cannot turn on the GPS module
-        return data;
+//Print a fixed point value as a decimal number
+static void format_fixed(char *buf, int32_t value, uint32_t scale, int digits){
+    uint32_t magnitude = (value < 0) ? -(uint32_t)value : (uint32_t)value;
+    sprintf(buf, "%s%lu.%0*lu", (value < 0) ? "-" : "", (unsigned long)(magnitude / scale),
+            digits, (unsigned long)(magnitude % scale));
+}
+
+static void format_fix(const gps_fix *fix, gps_data *data){
+    //Coordinates in the ISO 6709 decimal degrees
+    format_fixed(data->latitude, fix->latitude, 1000000, 6);
+    format_fixed(data->longitude, fix->longitude, 1000000, 6);
+    format_fixed(data->altitude, fix->altitude, 100, 2);
+    uint32_t s = fix->time / 1000;
+    sprintf(data->UTC, "%02lu%02lu%02lu.%03lu", (unsigned long)(s / 3600), (unsigned long)(s / 60 % 60),
+            (unsigned long)(s % 60), (unsigned long)(fix->time % 1000));
+}
+
+void MTSASInterface::gps_nmea(){
+    //$GPSNMUN: <NMEA sentence>
+    gps_fix fix;
+    int len = read_line(_gps_line, sizeof(_gps_line));
+    if (len < 0 || !gps_parse_gga(_gps_line, len, &fix)){
+        return;
     }
-    Timer t;
-    t.start(); 
-    bool fix = false;
-    //Timeout if we do not receive a gps location in two minutes
-    while(!fix && t.read()<120){
-        at_mutex.lock();
-        //Query the GPS location
-        _parser.send("AT$GPSACP");
-        //Parse the radio response
-        fix = _parser.recv("$GPSACP:%[^,],%[^,],%[^,],%*[^,],%[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^\n]", data.UTC, data.latitude, data.longitude, data.altitude);
+    //Fill the slot readers are not using, then publish it
+    uint32_t seq = _gps_seq + 1;
+    _gps_slot[seq & 1].fix = fix;
+    _gps_slot[seq & 1].stamp = _gps_clock.read_ms();
+    __DMB();
+    _gps_seq = seq;
+}
+
+bool MTSASInterface::gps_get_fix(gps_fix *fix, unsigned *age){
+    uint32_t seq;
+    uint32_t stamp;
+    //The published slot is never written, a writer preempted mid update does not hold readers up.
+    //Copy again only if a newer fix was published meanwhile, as the next one reuses this slot
+    do {
+        seq = _gps_seq;
+        __DMB();
+        *fix = _gps_slot[seq & 1].fix;
+        stamp = _gps_slot[seq & 1].stamp;
+        __DMB();
+    } while (seq != _gps_seq);
+    if (seq == 0){
+        //No fix published yet
+        return false;
+    }
+    if (age){
+        *age = (uint32_t)_gps_clock.read_ms() - stamp;
+    }
+    return true;
+}
+
+bool MTSASInterface::gps_query(gps_fix *fix){
+    if (!at_lock()){
+        return false;
+    }
+    bool res = false;
+    //Query the GPS location
+    if (_parser.send("AT$GPSACP") && _parser.recv("$GPSACP:")){
+        int len = read_line(_gps_line, sizeof(_gps_line));
+        res = len >= 0 && gps_parse_acp(_gps_line, len, fix);
         _parser.recv("OK");
-        at_mutex.unlock();
-        wait(4);
     }
-    set_gps_state(0);
-    if(fix){
-        //Format the coordinated to ISO 6709 if we got a GPS fix
-        format_data(&data);
+    at_unlock();
+    return res;
+}
+
+bool MTSASInterface::gps_stream(bool on){
+    if (!at_lock()){
+        return false;
+    }
+    bool res;
+    if (on){
+        //Power the receiver then enable unsolicited GGA sentences
+        //AT$GPSNMUN=<enable>,<GGA>,<GLL>,<GSA>,<GSV>,<RMC>,<VTG>
+        res = set_gps_state(1) && _parser.send("AT$GPSNMUN=1,1,0,0,0,0,0") && _parser.recv("OK");
     }
     else{
+        res = _parser.send("AT$GPSNMUN=0") && _parser.recv("OK");
+        res = set_gps_state(0) && res;
+    }
+    at_unlock();
+    return res;
+}
+
+void MTSASInterface::gps_engine(){
+    enum {GPS_IDLE, GPS_ON, GPS_OFF, GPS_RETRY} phase = GPS_IDLE;
+    uint32_t phase_start = _gps_clock.read_ms();
+    while(true){
+        //Length of the current phase under the current configuration, a new
+        //configuration moves the end of the phase rather than ending it
+        bool enabled = _gps_enabled;
+        uint32_t length;
+        switch (phase){
+            case GPS_ON:
+                length = !enabled ? 0 : _gps_off_time ? _gps_on_time * 1000 : osWaitForever;
+                break;
+            case GPS_OFF:
+                length = enabled ? _gps_off_time * 1000 : 0;
+                break;
+            case GPS_RETRY:
+                length = enabled ? MTSAS_GPS_RETRY_INTERVAL : 0;
+                break;
+            default:
+                length = enabled ? 0 : osWaitForever;
+                break;
+        }
+        uint32_t elapsed = (uint32_t)_gps_clock.read_ms() - phase_start;
+        if (length != osWaitForever && elapsed >= length){
+            //End of the phase, the receiver is only powered on or off here
+            if (phase == GPS_ON){
+                gps_stream(false);
+                phase = enabled ? GPS_OFF : GPS_IDLE;
+            }
+            else if (!enabled){
+                phase = GPS_IDLE;
+            }
+            else{
+                phase = gps_stream(true) ? GPS_ON : GPS_RETRY;
+            }
+            phase_start = _gps_clock.read_ms();
+            continue;
+        }
+        //Wait for the end of the phase, a token means the configuration changed and the phase is planned again
+        _gps_sem.wait((length == osWaitForever) ? osWaitForever : length - elapsed);
+    }
+}
+
+nsapi_error_t MTSASInterface::gps_start(unsigned on_time, unsigned off_time){
+    _gps_on_time = on_time;
+    _gps_off_time = on_time ? off_time : 0;
+    _gps_enabled = true;
+    if (!_gps_started){
+        if (gps_thread.start(callback(this, &MTSASInterface::gps_engine)) != osOK){
+            _gps_enabled = false;
+            return NSAPI_ERROR_NO_MEMORY;
+        }
+        _gps_started = true;
+    }
+    _gps_sem.release();
+    return 0;
+}
+
+void MTSASInterface::gps_stop(){
+    _gps_enabled = false;
+    if (_gps_started){
+        _gps_sem.release();
+    }
+}
+
+gps_data MTSASInterface::get_gps_location(const char* lat_default, const char* lon_default){
+    struct gps_data data = {"None", "None", "None", "None"};
+    //Run the GPS engine for the duration of the call unless it is already running
+    bool running = _gps_enabled;
+    bool fix = false;
+    if (running || gps_start() == 0){
+        Timer t;
+        t.start();
+        struct gps_fix latest;
+        unsigned age;
+        //Timeout if we do not receive a gps location in two minutes
+        while (!fix && t.read() < 120){
+            //Only accept fixes received during the call if we started the engine
+            fix = gps_get_fix(&latest, &age) && (running || (int)age <= t.read_ms());
+            if (!fix){
+                Thread::wait(MTSAS_GPS_POLL_INTERVAL);
+            }
+        }
+        if (!running){
+            gps_stop();
+        }
+        if (fix){
+            format_fix(&latest, &data);
+        }
+    }
+    if (!fix){
         //Use default values if we did not get a fix
         strcpy(data.latitude, lat_default);
         strcpy(data.longitude, lon_default);
     }
     return data;
 }
+#endif
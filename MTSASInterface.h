@@ -19,15 +19,154 @@
 
 #include "mbed.h"
 #include "ATParser.h" 
-#define MTSAS_SOCKET_COUNT 6
+#include "MTSASProfile.h"
+#include "MTSASGps.h"
+#include "MTSASSms.h"
+#define MTSAS_DEFAULT_BAUD 115200           // Rate of the radio's UART after a reboot
+#ifndef MTSAS_MAX_BAUD
+#define MTSAS_MAX_BAUD 921600               // Highest rate negotiated with the radio
+#endif
+#ifndef MTSAS_SERIAL_BUFFER_SIZE
+#define MTSAS_SERIAL_BUFFER_SIZE 1024       // Default size of the serial buffers
+#endif
+#define MTSAS_HTTP_PROFILE 0                // Profile of the radio's HTTP client used by http_request
+#define MTSAS_HTTP_TIMEOUT 120              // Seconds the radio waits for an HTTP server to respond
+#define MTSAS_GPS_LINE_SIZE 96              // Longest NMEA sentence accepted from the radio
+#ifndef MTSAS_HTTP_CHUNK_SIZE
+#define MTSAS_HTTP_CHUNK_SIZE 512           // Bytes of response body handed out per read from the radio
+#endif
+#ifndef MTSAS_SMS_QUEUE_SIZE
+#define MTSAS_SMS_QUEUE_SIZE 4              // Messages waiting for the SMS callback or being reassembled
+#endif
+#ifndef MTSAS_SMS_MAX_PARTS
+#define MTSAS_SMS_MAX_PARTS 4               // Parts of a concatenated message that are kept
+#endif
+#if MTSAS_SMS_MAX_PARTS > 31
+#error "MTSAS_SMS_MAX_PARTS must fit the bitmap of received parts"
+#endif
+#define MTSAS_SMS_PART_SIZE 160             // Longest decoded text message part
+#define MTSAS_SMS_MAX_LENGTH (MTSAS_SMS_PART_SIZE * MTSAS_SMS_MAX_PARTS)
+#define MTSAS_SMS_CONCAT_SLOTS 2            // Concatenated messages reassembled at the same time
+#define MTSAS_SMS_PDU_SIZE 176              // Longest PDU including the service centre address
+#ifndef MTSAS_SUPPLY_MV
+#define MTSAS_SUPPLY_MV 3800                // Supply voltage used for the energy estimates
+#endif
+#ifndef MTSAS_ACTIVE_UA
+#define MTSAS_ACTIVE_UA 25000               // Estimated radio current with the link awake
+#endif
+#ifndef MTSAS_SLEEP_UA
+#define MTSAS_SLEEP_UA 1500                 // Estimated radio current in UART sleep
+#endif
+#ifndef MTSAS_EDRX_UA
+#define MTSAS_EDRX_UA 600                   // Estimated radio current in UART sleep with eDRX
+#endif
+#ifndef MTSAS_PSM_UA
+#define MTSAS_PSM_UA 10                     // Estimated radio current in UART sleep with PSM
+#endif
 
+#if MTSAS_HAS_GPS
 struct gps_data{
     char latitude[25];
     char longitude[25];
     char UTC[25];
     char altitude[25];
 };
+#endif
+
+#if MTSAS_HAS_SMS
+/** Text message received by the radio
+ */
+struct sms_message {
+    char sender[MTSAS_SMS_SENDER_SIZE];     // Originating address
+    char timestamp[MTSAS_SMS_TIMESTAMP_SIZE]; // Service centre timestamp, yy/MM/dd,hh:mm:ss+zz
+    uint8_t encoding;                       // One of sms_encoding
+    uint16_t length;                        // Bytes in data
+    char data[MTSAS_SMS_MAX_LENGTH + 1];    // Payload, null terminated
+};
+
+/** Counters of the SMS pipeline
+ */
+struct sms_stats {
+    unsigned received;                      // PDUs received from the radio
+    unsigned delivered;                     // Messages handed to the callback
+    unsigned dropped;                       // PDUs or messages lost to a full queue or bad encoding
+    unsigned backlog;                       // Messages waiting for the callback
+};
+#endif
+
+#if MTSAS_HAS_HTTP
+/** HTTP methods supported by the radio's HTTP client
+ */
+enum mtsas_http_method {
+    MTSAS_HTTP_GET,
+    MTSAS_HTTP_HEAD,
+    MTSAS_HTTP_DELETE,
+    MTSAS_HTTP_POST,
+    MTSAS_HTTP_PUT
+};
+#endif
+
+/** Power states of the radio
+ */
+enum mtsas_power_state {
+    MTSAS_POWER_ACTIVE,                     // Serial link awake
+    MTSAS_POWER_SLEEP,                      // Serial link asleep, radio in idle mode
+    MTSAS_POWER_EDRX,                       // Serial link asleep, eDRX granted by the network
+    MTSAS_POWER_PSM,                        // Serial link asleep, PSM granted by the network
+    MTSAS_POWER_STATES
+};
+
+/** Power management report
+ */
+struct mtsas_power_stats {
+    unsigned time_ms[MTSAS_POWER_STATES];   // Time spent in each power state, PSM and eDRX once granted by the network
+    unsigned wakeups;                       // Times the link was woken for a command
+    unsigned wake_latency_ms;               // Time the last wakeup took
+    unsigned wake_latency_max_ms;           // Longest wakeup
+    unsigned wake_failures;                 // Wakeups the radio did not answer
+    unsigned energy_mj;                     // Estimated energy used by the radio
+    unsigned uj_per_kb;                     // Estimated energy per kilobyte transmitted
+};
 
+/** Counters for the traffic exchanged with the radio on the data path
+ *  (socket and HTTP operations)
+ */
+struct mtsas_link_stats {
+    unsigned commands;                      // AT commands issued
+    unsigned tx_bytes;                      // Payload bytes written to the radio
+    unsigned rx_bytes;                      // Payload bytes read from the radio
+    unsigned serial_tx_bytes;               // All bytes written to the radio, AT commands included
+    unsigned serial_rx_bytes;               // All bytes read from the radio, responses included
+    unsigned http_requests;                 // HTTP requests completed
+    unsigned http_latency_ms;               // Duration of the last HTTP request
+};
+
+struct mtsas_socket;
+
+/** BufferedSerial that counts the bytes exchanged with the radio
+ */
+class MTSASSerial : public BufferedSerial
+{
+public:
+    MTSASSerial(PinName tx, PinName rx, uint32_t buf_size)
+        : BufferedSerial(tx, rx, buf_size), tx_bytes(0), rx_bytes(0) {}
+
+    virtual int getc(void){
+        int c = BufferedSerial::getc();
+        if (c >= 0){
+            rx_bytes++;
+        }
+        return c;
+    }
+
+    virtual int putc(int c){
+        tx_bytes++;
+        return BufferedSerial::putc(c);
+    }
+
+    unsigned tx_bytes;                      // Bytes written, only changed under the AT mutex
+    unsigned rx_bytes;                      // Bytes read, only changed under the AT mutex
+};
  
 /** MTSASInterface class
  *  Implementation of the NetworkInterface for MTSAS 
@@ -36,12 +175,17 @@ class MTSASInterface : public NetworkStack, public CellularInterface
 {
 public:
     /** MTSASInterface
-     * @param tx      TX for radio communication
-     * @param rx      RX  for radio communication
-     * @param debug   Print out AT comands
-     * @param on_batt boolean for when the board is on the battery pack
+     * @param tx          TX for radio communication
+     * @param rx          RX  for radio communication
+     * @param debug       Print out AT comands
+     * @param rts         RTS for hardware flow control, NC to disable flow control
+     * @param cts         CTS for hardware flow control, NC to disable flow control
+     * @param buffer_size Size of the serial buffers
+     * @param max_baud    Highest rate to negotiate with the radio in init
+     * @param dtr         DTR of the radio, needed to put the serial link to sleep
      */
-    MTSASInterface(PinName tx, PinName rx, bool debug=false);
+    MTSASInterface(PinName tx, PinName rx, bool debug=false, PinName rts=NC, PinName cts=NC,
+            int buffer_size=MTSAS_SERIAL_BUFFER_SIZE, int max_baud=MTSAS_MAX_BAUD, PinName dtr=NC);
 
     ~MTSASInterface();
     /** Set the cellular network APN and credentials
@@ -90,28 +234,179 @@ public:
  
     nsapi_error_t gethostbyname(const char* name, SocketAddress *address, nsapi_version_t version);
 
+#if MTSAS_HAS_GPS
     /** Get the gps location of the device
+     *
+     *  Returns the latest fix if the GPS engine is running, otherwise runs the
+     *  engine for up to two minutes waiting for a fix
+     *
      *  @param lat_default  the default latitude if gps module fails to get a fix
      *  @param lon_default  the defauly longitude if gps module fails to get a fix
      *  @return             struct of type gps_data
      *  @note               Coordinates will be returned in the ISO 6709 format
      */
     virtual gps_data get_gps_location(const char* lat_default="None", const char* lon_default="None");   
+
+    /** Start the GPS engine
+     *
+     *  Keeps the GPS receiver powered and ingests fixes from its unsolicited
+     *  NMEA output in the background. With an off time the receiver is
+     *  duty cycled, otherwise it stays on until gps_stop is called.
+     *
+     *  @param on_time   Seconds the receiver stays on per cycle, 0 to keep it on
+     *  @param off_time  Seconds the receiver stays off per cycle
+     *  @return          0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t gps_start(unsigned on_time=0, unsigned off_time=0);
+
+    /** Stop the GPS engine and power off the GPS receiver
+     */
+    virtual void gps_stop();
+
+    /** Get the latest fix received by the GPS engine
+     *  @param fix   Destination for the fix
+     *  @param age   Optional destination for the age of the fix in milliseconds
+     *  @return      true if a fix has been received
+     *  @note Does not issue any AT command and never blocks on the radio
+     */
+    virtual bool gps_get_fix(gps_fix *fix, unsigned *age=0);
+
+    /** Query the GPS receiver for its current fix with AT$GPSACP
+     *  @param fix   Destination for the fix
+     *  @return      true if the receiver has a fix
+     *  @note The receiver must already be powered, e.g. by the GPS engine
+     */
+    virtual bool gps_query(gps_fix *fix);
     
+#endif
     /** Get the imei of the device
      *  @param imei the buffer in which to store the imei number
      */
     virtual void get_imei(char* imei);
+
+    /** Get the rate of the serial link to the radio
+     *  @return the rate negotiated in init, in baud
+     */
+    virtual int get_baud();
     
+#if MTSAS_HAS_SMS
     /** Attach a function to be called when a text is recevieds
      *  @param callback  function pointer to a callback that will accept the message 
      *  contents when a text is received.
      */
     virtual void sms_attach(void (*callback)(char *));
 
+    /** Attach a function to be called with each text message received
+     *
+     *  Messages are queued as they arrive and handed to the callback from a
+     *  worker thread, concatenated messages are delivered once all their
+     *  parts have arrived.
+     *
+     *  @param callback  function pointer to a callback that will accept the message
+     */
+    virtual void sms_attach(void (*callback)(sms_message *));
+
+    /** Get the counters of the SMS pipeline
+     *  @param stats  Destination for the counters
+     */
+    virtual void sms_get_stats(sms_stats *stats);
+#endif
+
+#if MTSAS_HAS_HTTP
+    /** Configure the radio's HTTP client for the server used by http_request
+     *  @param host          Hostname or IP address of the server
+     *  @param port          Port of the server
+     *  @param ssl           Use HTTPS
+     *  @param timeout       Seconds to wait for the server to respond
+     *  @param content_type  Content type of POST and PUT bodies
+     *  @return              0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t http_config(const char *host, int port=80, bool ssl=false,
+            int timeout=MTSAS_HTTP_TIMEOUT, const char *content_type="application/octet-stream");
+
+    /** Issue an HTTP request through the radio's HTTP client
+     *  @param method     HTTP method of the request
+     *  @param resource   Path of the resource on the server, e.g. "/index.html"
+     *  @param body       Request body for POST and PUT, ignored otherwise
+     *  @param body_size  Length of the request body
+     *  @param buffer     Buffer in which to store the response body, bytes that do
+     *                    not fit are discarded
+     *  @param size       The length of the buffer
+     *  @param status     Optional destination for the HTTP status code
+     *  @return           Number of body bytes stored on success, negative on failure
+     */
+    virtual int http_request(mtsas_http_method method, const char *resource,
+            const void *body, unsigned body_size, void *buffer, unsigned size, int *status=0);
+
+    /** Issue an HTTP request and stream the response body to a callback
+     *  @param method     HTTP method of the request
+     *  @param resource   Path of the resource on the server, e.g. "/index.html"
+     *  @param body       Request body for POST and PUT, ignored otherwise
+     *  @param body_size  Length of the request body
+     *  @param callback   Function called with each chunk of up to MTSAS_HTTP_CHUNK_SIZE
+     *                    bytes of the response body
+     *  @param data       Argument to pass to callback
+     *  @param status     Optional destination for the HTTP status code
+     *  @return           Length of the response body on success, negative on failure
+     *  @note The callback runs with the AT parser locked and must not call
+     *        back into the interface
+     */
+    virtual int http_request(mtsas_http_method method, const char *resource,
+            const void *body, unsigned body_size,
+            void (*callback)(void *, const char *, unsigned), void *data, int *status=0);
+#endif
+
+    /** Get the counters for the traffic exchanged with the radio
+     *  @param stats  Destination for the counters
+     */
+    virtual void get_link_stats(mtsas_link_stats *stats);
+
+    /** Reset the traffic counters
+     */
+    virtual void reset_link_stats();
+
+    /** Let the serial link sleep when idle
+     *
+     *  The radio is put in UART sleep (AT+CFUN=5 with DTR deasserted) once no
+     *  command has been issued for the idle time, and woken up again by the
+     *  next command. With a batch window, sends issued while the link sleeps
+     *  are held back and go out together when the window ends.
+     *
+     *  @param idle_time     Milliseconds without commands before sleeping, 0 to stay awake
+     *  @param batch_window  Milliseconds sends are held back while asleep, 0 to send at once
+     *  @return              0 on success, negative error code on failure
+     *  @note Must be called again after connect, which reboots the radio
+     */
+    virtual nsapi_error_t power_sleep(unsigned idle_time, unsigned batch_window=0);
+
+#if MTSAS_HAS_PSM
+    /** Request power saving mode from the network
+     *  @param enable       Request or release PSM
+     *  @param periodic_tau Requested periodic TAU timer, 8 bit string as in 3GPP TS 24.008
+     *  @param active_time  Requested active time, 8 bit string as in 3GPP TS 24.008
+     *  @return             0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t power_psm(bool enable, const char *periodic_tau="00100001",
+            const char *active_time="00000001");
+
+    /** Request extended discontinuous reception from the network
+     *  @param enable  Request or release eDRX
+     *  @param cycle   Requested eDRX cycle, 4 bit string as in 3GPP TS 24.008
+     *  @return        0 on success, negative error code on failure
+     */
+    virtual nsapi_error_t power_edrx(bool enable, const char *cycle="0101");
+#endif
+
+    /** Get the power management report
+     *  @param stats  Destination for the report
+     */
+    virtual void power_get_stats(mtsas_power_stats *stats);
+
 protected:
+#if MTSAS_HAS_GPS
     virtual bool set_gps_state(int state);
     virtual int get_gps_state();
+#endif
   
 
     /** Provide access to the NetworkStack object
@@ -228,17 +523,18 @@ private:
     int context;                            // CELL PDP context
     // AT Parser variables
     bool _debug;                            // debug print for AT parser
-    BufferedSerial _serial;                 // Serial object for parser to communicate with radio
+    MTSASSerial _serial;                    // Serial object for parser to communicate with radio
+    int _baud;                              // Current rate of the serial link
+    int _max_baud;                          // Highest rate to negotiate
+    bool _flow_control;                     // RTS/CTS flow control in use
+    bool link_check();                      // Check that the radio answers at the current rate
+    bool sync_baud();                       // Find the rate the radio is using
+    void negotiate_baud();                  // Move the link to the highest rate that works
     ATParser _parser;                       // Send AT commands and parse responses
     Thread event_thread;                    // Thread to poll for SRING indicating incoming socket data
-    Thread sms_event_thread;
     Mutex at_mutex;                         // Mutex that only allows one thread at a time to execute AT Commands
     SocketAddress _ip_address;              // Local IP address
     Semaphore rx_sem;                       // Semphore to signal event_thread to check SRING
-    Semaphore sms_rx_sem;                   // Semaphore to signal sms_event_thread to check for incoming text 
-    void sms_rx_sem_release();              // Release the sms semaphore on serial RX
-    void sms_listen();                      // Configure device to listen for text messages 
-    void handle_sms_event();                // Handle incoming text data
     char _mac_address[NSAPI_MAC_SIZE];      // local Mac
     char _pin[sizeof("1234")];              // Cell pin
     void event();                           // Event signifying socket rcv data 	
@@ -249,7 +545,103 @@ private:
         void (*callback)(void *);
         void *data;
     } _cbs[MTSAS_SOCKET_COUNT];             // Callbacks for socket_attach 
+    mtsas_link_stats _stats;                // Data path traffic counters
+    bool at_lock();                         // Lock the AT mutex, waking the link if it sleeps, false if it does not wake
+    void at_unlock();                       // Unlock the AT mutex, restarting the idle time
+    int send_data(mtsas_socket *socket, const void *data, unsigned size); // Issue #SSENDEXT, all or nothing
+    bool socket_batch(mtsas_socket *socket, const void *data, unsigned size); // Hold back a send
+    bool socket_flush(mtsas_socket *socket);// Send the data held back for a socket, false if some is left
+    mtsas_socket *_sockets[MTSAS_SOCKET_COUNT]; // Open sockets
+    DigitalOut *_dtr;                       // DTR of the radio, null if not connected
+    Thread power_thread;                    // Thread to put the link to sleep and flush batched sends
+    void power_manager();                   // To be used by power_thread
+    void power_enter_sleep();               // Put the link to sleep
+    void power_read_grant();                // Read back whether the network granted PSM and eDRX
+    bool power_wake();                      // Wake the link up, false if the radio does not answer
+    void power_account(mtsas_power_state state); // Account the time spent in the current state
+    Semaphore _power_sem;                   // Semaphore to signal power_thread that the configuration changed
+    Timer _power_clock;                     // Time base for power management
+    bool _power_started;                    // power_thread has been started
+    volatile bool _power_asleep;            // Serial link asleep
+    unsigned _power_idle_time;              // Milliseconds without commands before sleeping
+    unsigned _power_batch_window;           // Milliseconds sends are held back while asleep
+    bool _power_flush_pending;              // Sends are held back
+    int _power_flush_at;                    // Time the held back sends go out
+    bool _power_flush_retry;                // The last flush left data behind, wait for _power_flush_at
+    int _power_last_activity;               // Time the last command completed
+    bool _power_psm;                        // PSM requested
+    bool _power_edrx;                       // eDRX requested
+    bool _power_psm_granted;                // PSM granted by the network when last checked
+    bool _power_edrx_granted;               // eDRX granted by the network when last checked
+    mtsas_power_state _power_state;         // Current power state
+    int _power_since;                       // Time the current power state was entered
+    unsigned _power_time[MTSAS_POWER_STATES]; // Time spent in each power state
+    unsigned _power_wakeups;                // Times the link was woken
+    unsigned _power_wake_failures;          // Times the radio did not answer a wakeup
+    unsigned _power_tx_bytes;               // Bytes transmitted, not cleared by reset_link_stats
+    unsigned _power_latency;                // Time the last wakeup took
+    unsigned _power_latency_max;            // Longest wakeup
+    bool send_cmd(const char *prefix, unsigned prefix_len, const int *args, int count,
+            const char *suffix=NULL);       // Send a command without going through vsprintf
+    int read_int(int *value);               // Read a decimal number from the radio
+    void set_timeout(int timeout);          // Set the parser timeout, read back through _timeout
+    int _timeout;                           // Current parser timeout
+    int read_line(char *line, int size);    // Read the rest of a line following an out of band prefix
+#if MTSAS_HAS_SMS
+    Thread sms_event_thread;                // Thread to hand queued text messages to the SMS callback
+    void sms_listen();                      // Configure device to listen for text messages 
+    void handle_sms_event();                // To be used by sms_event_thread to drain the message queue
+    void sms_cmt();                         // Handle +CMT indicating an incoming text message
+    void sms_store(struct sms_pdu *pdu);    // Queue a message or add it to a concatenated message
     void (*_sms_cb)(char *);                // Callback when text message is received 
+    void (*_sms_msg_cb)(sms_message *);     // Callback with the full message when a text is received
+    bool _sms_started;                      // sms_event_thread has been started
+    Mail<sms_message, MTSAS_SMS_QUEUE_SIZE> _sms_queue; // Messages waiting for the SMS callback
+    struct {
+        sms_message *msg;                   // Message being reassembled, null when free
+        uint16_t ref;                       // Reference number of the message
+        uint8_t total;                      // Parts kept of the message
+        uint32_t received;                  // Bitmap of the parts received
+        uint16_t part_len[MTSAS_SMS_MAX_PARTS];
+        unsigned stamp;                     // Order of use, the oldest is evicted when all are busy
+    } _sms_concat[MTSAS_SMS_CONCAT_SLOTS];  // Concatenated messages being reassembled
+    unsigned _sms_stamp;                    // Last stamp given to a concatenated message
+    char _sms_line[2 * MTSAS_SMS_PDU_SIZE + 1]; // Buffer for PDUs
+    unsigned _sms_received;                 // PDUs received
+    unsigned _sms_queued;                   // Messages queued, written by the parser only
+    unsigned _sms_delivered;                // Messages delivered, written by sms_event_thread only
+    unsigned _sms_dropped;                  // PDUs or messages dropped
+#endif
+#if MTSAS_HAS_HTTP
+    void http_ring();                       // Handle #HTTPRING indicating an HTTP response is ready
+    int http_exchange(mtsas_http_method method, const char *resource, const void *body, unsigned body_size,
+            void (*callback)(void *, const char *, unsigned), void *data, int *status); // Run a request, _http_mutex held
+    Mutex _http_mutex;                      // Mutex that only allows one HTTP request at a time
+    Semaphore _http_sem;                    // Semaphore to signal that an HTTP response is ready
+    int _http_status;                       // Status code of the last HTTP response
+    int _http_size;                         // Body size of the last HTTP response
+    int _http_timeout;                      // Seconds the radio waits for the HTTP server
+    char _http_content_type[64];            // Content type of POST and PUT bodies
+    char _http_chunk[MTSAS_HTTP_CHUNK_SIZE];// Buffer for streaming HTTP response bodies
+#endif
+#if MTSAS_HAS_GPS
+    Thread gps_thread;                      // Thread to power the GPS receiver according to the duty cycle
+    void gps_engine();                      // To be used by gps_thread to run the duty cycle
+    bool gps_stream(bool on);               // Power the GPS receiver and its NMEA output on or off
+    void gps_nmea();                        // Handle unsolicited NMEA sentences
+    Semaphore _gps_sem;                     // Semaphore to signal gps_thread that the configuration changed
+    volatile bool _gps_enabled;             // GPS engine requested to run
+    bool _gps_started;                      // gps_thread has been started
+    unsigned _gps_on_time;                  // Seconds the receiver stays on per cycle
+    unsigned _gps_off_time;                 // Seconds the receiver stays off per cycle
+    char _gps_line[MTSAS_GPS_LINE_SIZE];    // Buffer for NMEA sentences
+    Timer _gps_clock;                       // Time base for the age of fixes
+    volatile uint32_t _gps_seq;             // Fixes published, the latest is in _gps_slot[_gps_seq & 1]
+    struct {
+        gps_fix fix;
+        uint32_t stamp;                     // Time the fix was received
+    } _gps_slot[2];                         // Latest fix and the one being written
+#endif
 };
 
 #endif
@@ -0,0 +1,74 @@
+/* MTSAS radio capability profiles
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTSAS_PROFILE_H
+#define MTSAS_PROFILE_H
+
+/** Radio profile
+ *
+ *  Select the radio on the dragonfly at compile time by defining one of
+ *  MTSAS_MODEM_LE910 (LTE) or MTSAS_MODEM_HE910 (HSPA+), for example in the
+ *  "macros" of mbed_app.json. The LE910 is used if neither is defined.
+ *
+ *  Each capability can also be overridden on its own. Features the radio
+ *  does not have are compiled out of MTSASInterface.
+ */
+#if !defined(MTSAS_MODEM_LE910) && !defined(MTSAS_MODEM_HE910)
+#define MTSAS_MODEM_LE910
+#endif
+
+#if defined(MTSAS_MODEM_LE910)
+#define MTSAS_MODEM_NAME "LE910"
+#ifndef MTSAS_HAS_HTTP
+#define MTSAS_HAS_HTTP 1                    // #HTTPCFG client
+#endif
+#ifndef MTSAS_HAS_PSM
+#define MTSAS_HAS_PSM 1                     // +CPSMS and +CEDRXS
+#endif
+
+#elif defined(MTSAS_MODEM_HE910)
+#define MTSAS_MODEM_NAME "HE910"
+#ifndef MTSAS_HAS_HTTP
+#define MTSAS_HAS_HTTP 0                    // #HTTPCFG needs firmware 12.00.xx4 or later
+#endif
+#ifndef MTSAS_HAS_PSM
+#define MTSAS_HAS_PSM 0                     // PSM and eDRX are LTE only
+#endif
+#endif
+
+#ifndef MTSAS_SOCKET_COUNT
+#define MTSAS_SOCKET_COUNT 6                // Socket connection ids
+#endif
+#ifndef MTSAS_SEND_MAX
+#define MTSAS_SEND_MAX 1500                 // Largest #SSENDEXT
+#endif
+#ifndef MTSAS_RECV_MAX
+#define MTSAS_RECV_MAX 1500                 // Largest #SRECV
+#endif
+#ifndef MTSAS_SRING_MODE
+#define MTSAS_SRING_MODE 0                  // #SCFGEXT SRING format, 0 socket id, 1 socket id and bytes pending
+#endif
+#if MTSAS_SRING_MODE > 1
+#error "SRING data view mode would interleave socket data with responses"
+#endif
+#ifndef MTSAS_HAS_GPS
+#define MTSAS_HAS_GPS 1                     // $GPSP receiver
+#endif
+#ifndef MTSAS_HAS_SMS
+#define MTSAS_HAS_SMS 1                     // +CMT text messages
+#endif
+
+#endif
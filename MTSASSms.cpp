@@ -0,0 +1,216 @@
+/* MTSAS SMS PDU decoding
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MTSASSms.h"
+#include <stdio.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////
+//SMS PDU decoding
+////////////////////////////////////////////////////////////////////////
+static int hex_value(char c){
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+int sms_hex_decode(char *line, int len){
+    uint8_t *out = (uint8_t *)line;
+    int n = 0;
+    for (int i = 0; i + 1 < len; i += 2){
+        int hi = hex_value(line[i]);
+        int lo = hex_value(line[i + 1]);
+        if (hi < 0 || lo < 0){
+            return -1;
+        }
+        out[n++] = (hi << 4) | lo;
+    }
+    return n;
+}
+
+static char gsm7_to_ascii(uint8_t c, bool escaped){
+    if (escaped){
+        //Extension table
+        switch (c){
+            case 0x14: return '^';
+            case 0x28: return '{';
+            case 0x29: return '}';
+            case 0x2F: return '\\';
+            case 0x3C: return '[';
+            case 0x3D: return '~';
+            case 0x3E: return ']';
+            case 0x40: return '|';
+            default: return '?';
+        }
+    }
+    switch (c){
+        case 0x00: return '@';
+        case 0x02: return '$';
+        case 0x0A: return '\n';
+        case 0x0D: return '\r';
+        case 0x11: return '_';
+    }
+    //Digits, unaccented letters and most punctuation share their ASCII codes
+    if ((c >= 0x20 && c <= 0x5A && c != 0x24 && c != 0x40) || (c >= 0x61 && c <= 0x7A)){
+        return c;
+    }
+    return '?';
+}
+
+//Unpack septets [first, count) of GSM 7 bit packed data into ASCII
+static int gsm7_unpack(const uint8_t *data, int size, int first, int count, char *out, int out_size){
+    int n = 0;
+    bool escaped = false;
+    for (int i = first; i < count && n < out_size; i++){
+        int bit = i * 7;
+        int byte = bit / 8;
+        int shift = bit % 8;
+        if (byte >= size){
+            break;
+        }
+        uint8_t c = data[byte] >> shift;
+        if (shift > 1 && byte + 1 < size){
+            c |= data[byte + 1] << (8 - shift);
+        }
+        c &= 0x7F;
+        if (c == 0x1B && !escaped){
+            escaped = true;
+            continue;
+        }
+        out[n++] = gsm7_to_ascii(c, escaped);
+        escaped = false;
+    }
+    return n;
+}
+
+static int bcd_digit(uint8_t b){
+    //Semi-octets are stored low nibble first, malformed ones are kept to two digits
+    return ((b & 0x0F) * 10 + (b >> 4)) % 100;
+}
+
+bool sms_parse_pdu(const uint8_t *pdu, int len, sms_pdu *info){
+    /**
+    SMS-DELIVER PDU:
+    <SMSC length><SMSC address><first octet><sender length><sender type><sender address>
+    <PID><DCS><timestamp (7 octets)><UDL><UD>
+    **/
+    if (len < 1 || 1 + pdu[0] + 2 > len){
+        return false;
+    }
+    int i = 1 + pdu[0];
+    uint8_t first = pdu[i++];
+    //Only SMS-DELIVER is expected in a +CMT
+    if ((first & 0x03) != 0){
+        return false;
+    }
+    int digits = pdu[i++];
+    int oa_size = (digits + 1) / 2;
+    if (digits > 20 || i + 1 + oa_size + 10 > len){
+        return false;
+    }
+    uint8_t type = pdu[i++];
+    const uint8_t *oa = pdu + i;
+    i += oa_size;
+    if ((type & 0x70) == 0x50){
+        //Alphanumeric sender in GSM 7 bit
+        int n = gsm7_unpack(oa, oa_size, 0, digits * 4 / 7, info->sender, sizeof(info->sender) - 1);
+        info->sender[n] = '\0';
+    }
+    else{
+        int n = 0;
+        if ((type & 0x70) == 0x10){
+            //International number
+            info->sender[n++] = '+';
+        }
+        for (int d = 0; d < digits; d++){
+            uint8_t nibble = (d & 1) ? (oa[d / 2] >> 4) : (oa[d / 2] & 0x0F);
+            info->sender[n++] = (nibble < 10) ? '0' + nibble : "*#abc?"[(nibble - 10 < 5) ? nibble - 10 : 5];
+        }
+        info->sender[n] = '\0';
+    }
+    i++;  //PID
+    uint8_t dcs = pdu[i++];
+    if ((dcs & 0x80) == 0x00){
+        //General data coding, and the automatic deletion group which codes the alphabet the same way
+        int alphabet = (dcs >> 2) & 0x03;
+        info->encoding = (alphabet == 1) ? SMS_ENCODING_8BIT :
+                         (alphabet == 2) ? SMS_ENCODING_UCS2 : SMS_ENCODING_GSM7;
+    }
+    else if ((dcs & 0xF0) == 0xF0){
+        info->encoding = (dcs & 0x04) ? SMS_ENCODING_8BIT : SMS_ENCODING_GSM7;
+    }
+    else{
+        info->encoding = ((dcs & 0xF0) == 0xE0) ? SMS_ENCODING_UCS2 : SMS_ENCODING_GSM7;
+    }
+    const uint8_t *ts = pdu + i;
+    i += 7;
+    //Time zone in quarters of an hour, the sign is bit 3
+    snprintf(info->timestamp, sizeof(info->timestamp), "%02d/%02d/%02d,%02d:%02d:%02d%c%02d", bcd_digit(ts[0]), bcd_digit(ts[1]),
+            bcd_digit(ts[2]), bcd_digit(ts[3]), bcd_digit(ts[4]), bcd_digit(ts[5]),
+            (ts[6] & 0x08) ? '-' : '+', bcd_digit(ts[6] & 0xF7));
+    info->udl = pdu[i++];
+    info->ud = pdu + i;
+    info->ud_size = len - i;
+    info->ref = 0;
+    info->total = 1;
+    info->seq = 1;
+    info->skip = 0;
+    int ud_octets = (info->encoding == SMS_ENCODING_GSM7) ? (info->udl * 7 + 7) / 8 : info->udl;
+    if (ud_octets > info->ud_size || ud_octets > 140){
+        return false;
+    }
+    if ((first & 0x40) && info->udl > 0){
+        //User data header
+        int udhl = info->ud[0];
+        if (udhl + 1 > ud_octets){
+            return false;
+        }
+        for (int h = 1; h + 1 < udhl + 1; h += 2 + info->ud[h + 1]){
+            const uint8_t *ie = info->ud + h;
+            if (h + 2 + ie[1] > udhl + 1){
+                break;
+            }
+            if (ie[0] == 0x00 && ie[1] == 3){
+                //Concatenated message, 8 bit reference
+                info->ref = ie[2];
+                info->total = ie[3];
+                info->seq = ie[4];
+            }
+            else if (ie[0] == 0x08 && ie[1] == 4){
+                //Concatenated message, 16 bit reference
+                info->ref = (ie[2] << 8) | ie[3];
+                info->total = ie[4];
+                info->seq = ie[5];
+            }
+        }
+        //The header is padded to a septet boundary in GSM 7 bit
+        info->skip = (info->encoding == SMS_ENCODING_GSM7) ? ((udhl + 1) * 8 + 6) / 7 : udhl + 1;
+    }
+    return info->total > 0 && info->seq > 0 && info->seq <= info->total;
+}
+
+int sms_decode_ud(const sms_pdu *info, char *out, int size){
+    if (info->encoding == SMS_ENCODING_GSM7){
+        return gsm7_unpack(info->ud, info->ud_size, info->skip, info->udl, out, size);
+    }
+    int n = info->udl - info->skip;
+    if (n > size){
+        n = size;
+    }
+    memcpy(out, info->ud + info->skip, n);
+    return n;
+}
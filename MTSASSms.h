@@ -0,0 +1,75 @@
+/* MTSAS SMS PDU decoding
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef MTSAS_SMS_H
+#define MTSAS_SMS_H
+
+#include <stdint.h>
+
+/* The PDU decoder only depends on the C library so it can be built and
+ * exercised on a host, see test/
+ */
+
+#define MTSAS_SMS_SENDER_SIZE 24            // Longest originating address, null terminated
+#define MTSAS_SMS_TIMESTAMP_SIZE 21         // yy/MM/dd,hh:mm:ss+zz, null terminated
+
+/** Encodings of text message payloads
+ */
+enum sms_encoding {
+    SMS_ENCODING_GSM7,                      // GSM default alphabet, converted to ASCII
+    SMS_ENCODING_8BIT,                      // Binary data
+    SMS_ENCODING_UCS2                       // UCS-2, big endian
+};
+
+/** SMS-DELIVER PDU split into its fields
+ */
+struct sms_pdu {
+    char sender[MTSAS_SMS_SENDER_SIZE];     // Originating address
+    char timestamp[MTSAS_SMS_TIMESTAMP_SIZE]; // Service centre timestamp, yy/MM/dd,hh:mm:ss+zz
+    uint8_t encoding;                       // One of sms_encoding
+    uint16_t ref;                           // Concatenated message reference
+    uint8_t total;                          // Parts in the concatenated message, 1 if not concatenated
+    uint8_t seq;                            // Part number, starting at 1
+    const uint8_t *ud;                      // User data
+    int ud_size;                            // Octets available in the user data
+    int udl;                                // User data length, septets for GSM 7 bit
+    int skip;                               // Leading septets or octets taken by the user data header
+};
+
+/** Convert hex digits to octets in place
+ *  @param line  The hex digits, overwritten with the octets
+ *  @param len   Number of hex digits
+ *  @return      Number of octets, or -1 if a digit is not hex
+ */
+int sms_hex_decode(char *line, int len);
+
+/** Parse an SMS-DELIVER PDU
+ *  @param pdu   The PDU, starting with the service centre address
+ *  @param len   Length of the PDU in octets
+ *  @param info  Destination for the fields, the user data points into pdu
+ *  @return      true if the PDU is a well formed SMS-DELIVER
+ */
+bool sms_parse_pdu(const uint8_t *pdu, int len, sms_pdu *info);
+
+/** Decode the user data of a parsed PDU, without its header
+ *  @param info  The parsed PDU
+ *  @param out   Destination for the text, GSM 7 bit is converted to ASCII
+ *  @param size  Size of out, the text is not null terminated
+ *  @return      Number of bytes written to out
+ */
+int sms_decode_ud(const sms_pdu *info, char *out, int size);
+
+#endif
@@ -0,0 +1,112 @@
+/* Micro-benchmark of the MTSAS GPS parsers
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MTSASGps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Compares gps_parse_acp with the path it replaced: sscanf of the $GPSACP
+ * response into gps_data strings, then format_data and find_dir converting
+ * them with atof and sprintf. The old code is reproduced below, with the
+ * degree and minute copies made one byte longer and zeroed so atof stays in
+ * bounds on the host.
+ */
+
+struct gps_data{
+    char latitude[25];
+    char longitude[25];
+    char UTC[25];
+    char altitude[25];
+};
+
+static int find_dir(char* coord){
+    int i = 0;
+    while (coord[i] != 'W' && coord[i] != 'N' && coord[i] != 'S' && coord[i] != 'E'){
+        i++;
+    }
+    char dir = coord[i];
+    return (dir == 'W' || dir == 'S') ? -1 : 1;
+}
+
+//The truncating copies are the behaviour being measured
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wstringop-truncation"
+#endif
+static void format_data(gps_data* data){
+    char lat_deg[3] = {0};
+    char long_deg[4] = {0};
+    char lat_min[7] = {0};
+    char long_min[7] = {0};
+    strncpy(lat_deg, data->latitude, 2);
+    strncpy(long_deg, data->longitude, 3);
+    strncpy(lat_min, data->latitude+2, 6);
+    strncpy(long_min, data->longitude+3, 6);
+    int lat_dir = find_dir(data->latitude);
+    int long_dir = find_dir(data->longitude);
+    memset(&data->longitude[0], 0, sizeof(data->longitude));
+    memset(&data->latitude[0], 0, sizeof(data->latitude));
+    float lat = lat_dir * (atof(lat_deg) + atof(lat_min)/60);
+    float lon = long_dir * (atof(long_deg) + atof(long_min)/60);
+    sprintf(data->latitude, "%f", lat);
+    sprintf(data->longitude, "%f", lon);
+}
+
+static bool legacy_parse(const char *line, gps_data *data){
+    if (sscanf(line, "$GPSACP:%[^,],%[^,],%[^,],%*[^,],%[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^,],%*[^\n]",
+               data->UTC, data->latitude, data->longitude, data->altitude) != 4){
+        return false;
+    }
+    format_data(data);
+    return true;
+}
+
+static double now(){
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv){
+    unsigned long runs = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    static const char line[] = "$GPSACP: 123519.000,4807.0380N,01131.0000E,0.9,545.40,3,0.0,0.0,0.0,230394,08";
+    //Keep the compiler from hoisting the parse out of the loop
+    volatile unsigned len = sizeof(line) - 1;
+    volatile int32_t sink = 0;
+
+    double start = now();
+    for (unsigned long i = 0; i < runs; i++){
+        gps_data data;
+        if (legacy_parse(line, &data)){
+            sink = sink + data.latitude[0];
+        }
+    }
+    double legacy = (now() - start) * 1e9 / runs;
+
+    start = now();
+    for (unsigned long i = 0; i < runs; i++){
+        gps_fix fix;
+        if (gps_parse_acp(line, len, &fix)){
+            sink = sink + fix.latitude;
+        }
+    }
+    double fixed = (now() - start) * 1e9 / runs;
+
+    printf("sscanf + format_data: %8.1f ns/fix\n", legacy);
+    printf("gps_parse_acp:        %8.1f ns/fix (%.1fx)\n", fixed, legacy / fixed);
+    return 0;
+}
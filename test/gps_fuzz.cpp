@@ -0,0 +1,133 @@
+/* Fuzz test for the MTSAS GPS parsers
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MTSASGps.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Built with libFuzzer (make libfuzzer) the parsers are driven through
+ * LLVMFuzzerTestOneInput. Otherwise main checks known sentences then feeds
+ * random and mutated ones, built with ASan and UBSan (make fuzz).
+ */
+
+static const char *samples[] = {
+    "$GPSACP: 123519.000,4807.0380N,01131.0000E,0.9,545.40,3,0.0,0.0,0.0,230394,08",
+    "123519.000,4807.0380S,01131.0000W,0.9,-12.5,2,0.0,0.0,0.0,230394,08",
+    "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47",
+    "$GNGGA,235959.999,8959.9999,S,17959.9999,W,2,12,1.0,-5.00,M,0.0,M,,*62",
+    "$GPSACP: ,,,,,1,,,,,",
+    "$GPGGA,,,,,,0,00,99.99,,,,,,*48",
+    //Without a checksum, so mutations reach the field parsers
+    "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,",
+    //Corrupted: the time and the checksum disagree
+    "$GPGGA,123518,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*47",
+    //Truncated checksum
+    "$GPGGA,123519,4807.038,N,01131.000,E,1,08,0.9,545.4,M,46.9,M,,*4",
+};
+
+static void check(const gps_fix *fix){
+    if (fix->latitude < -90000000 || fix->latitude > 90000000 ||
+        fix->longitude < -180000000 || fix->longitude > 180000000 ||
+        fix->time >= 86401000 || fix->date > 999999 ||
+        fix->quality == 0 || fix->quality > 9 || fix->satellites > 99){
+        abort();
+    }
+}
+
+//Copy the input into an exact sized buffer so reads past the end are caught
+static void run(const uint8_t *data, size_t size){
+    char *line = (char *)malloc(size ? size : 1);
+    memcpy(line, data, size);
+    gps_fix fix;
+    gps_fix untouched;
+    memset(&fix, 0xA5, sizeof(fix));
+    memcpy(&untouched, &fix, sizeof(fix));
+    if (gps_parse_acp(line, size, &fix)){
+        check(&fix);
+    }
+    else if (memcmp(&fix, &untouched, sizeof(fix))){
+        abort();
+    }
+    memcpy(&fix, &untouched, sizeof(fix));
+    if (gps_parse_gga(line, size, &fix)){
+        check(&fix);
+    }
+    else if (memcmp(&fix, &untouched, sizeof(fix))){
+        abort();
+    }
+    free(line);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    run(data, size);
+    return 0;
+}
+
+#ifndef MTSAS_LIBFUZZER
+static bool expect(bool acp, const char *line, int32_t lat, int32_t lon, int32_t alt, uint32_t time){
+    gps_fix fix;
+    bool res = acp ? gps_parse_acp(line, strlen(line), &fix) : gps_parse_gga(line, strlen(line), &fix);
+    if (!res || fix.latitude != lat || fix.longitude != lon || fix.altitude != alt || fix.time != time){
+        printf("FAIL %s\n", line);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv){
+    unsigned long runs = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    bool ok = expect(true, samples[0], 48117300, 11516666, 54540, 45319000) &&
+              expect(true, samples[1], -48117300, -11516666, -1250, 45319000) &&
+              expect(false, samples[2], 48117300, 11516666, 54540, 45319000) &&
+              expect(false, samples[3], -89999998, -179999998, -500, 86399999) &&
+              expect(false, samples[6], 48117300, 11516666, 54540, 45319000);
+    gps_fix fix;
+    ok = ok && !gps_parse_acp(samples[4], strlen(samples[4]), &fix) &&
+               !gps_parse_gga(samples[5], strlen(samples[5]), &fix) &&
+               !gps_parse_gga(samples[7], strlen(samples[7]), &fix) &&
+               !gps_parse_gga(samples[8], strlen(samples[8]), &fix);
+    if (!ok){
+        printf("known sentences failed\n");
+        return 1;
+    }
+    //Random bytes biased towards the characters the parsers look for
+    static const char alphabet[] = "0123456789,.-$*NSEWGPAC: \r\n";
+    uint8_t buf[128];
+    srand(1);
+    for (unsigned long i = 0; i < runs; i++){
+        size_t size = rand() % sizeof(buf);
+        if (i & 1){
+            //Mutate a known sentence
+            const char *sample = samples[rand() % (sizeof(samples) / sizeof(samples[0]))];
+            size_t len = strlen(sample);
+            size = (size < len) ? size : len;
+            memcpy(buf, sample, size);
+            for (int n = rand() % 4; n >= 0 && size; n--){
+                buf[rand() % size] = alphabet[rand() % (sizeof(alphabet) - 1)];
+            }
+        }
+        else{
+            for (size_t n = 0; n < size; n++){
+                buf[n] = (rand() & 1) ? alphabet[rand() % (sizeof(alphabet) - 1)] : rand();
+            }
+        }
+        run(buf, size);
+    }
+    printf("%lu inputs ok\n", runs);
+    return 0;
+}
+#endif
@@ -0,0 +1,163 @@
+/* Fuzz test for the MTSAS SMS PDU decoder
+ * Copyright (c) 2015 ARM Limited
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "MTSASSms.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Built with libFuzzer (make libfuzzer) the decoder is driven through
+ * LLVMFuzzerTestOneInput. Otherwise main checks known PDUs then feeds
+ * random and mutated ones, built with ASan and UBSan (make fuzz).
+ */
+
+//SMS-DELIVER PDUs as the radio prints them after +CMT, all from +31641600986
+//at 99/03/29,15:16:59+08 unless noted
+static const char *samples[] = {
+    //GSM 7 bit "hellohello a{b}", with escaped characters
+    "07911326040000F0040B911346610089F600009930925161958011E8329BFD4697D9EC3728BC41893729",
+    //8 bit 00 01 FF 80
+    "07911326040000F0040B911346610089F6000499309251619580040001FF80",
+    //8 bit, automatic deletion group DCS 0x44
+    "07911326040000F0040B911346610089F6004499309251619580040001FF80",
+    //UCS2 "Hi"
+    "07911326040000F0040B911346610089F60008993092516195800400480069",
+    //GSM 7 bit part 1 of 2 with an 8 bit reference 0xA7, "part1"
+    "07911326040000F0440B911346610089F60000993092516195800C050003A70201E061393D06",
+    //GSM 7 bit part 2 of 3 with a 16 bit reference 0x1234, "two"
+    "07911326040000F0440B911346610089F60000993092516195800B06080412340302F4FB1B",
+    //GSM 7 bit "hi" from the alphanumeric sender "Alerts"
+    "07911326040000F0040BD04176594E9F0300009930925161958002E834",
+};
+#define SAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+static int decode(const char *hex, uint8_t *pdu, int size){
+    int len = strlen(hex);
+    if (len > size * 2){
+        return -1;
+    }
+    memcpy(pdu, hex, len);
+    return sms_hex_decode((char *)pdu, len);
+}
+
+static bool expect(int sample, const char *sender, int encoding, int ref, int total, int seq,
+                   const char *data, int data_len){
+    uint8_t pdu[200];
+    char out[200];
+    sms_pdu info;
+    int len = decode(samples[sample], pdu, sizeof(pdu));
+    if (len < 0 || !sms_parse_pdu(pdu, len, &info)){
+        printf("FAIL %d: not parsed\n", sample);
+        return false;
+    }
+    int n = sms_decode_ud(&info, out, sizeof(out));
+    if (strcmp(info.sender, sender) || strcmp(info.timestamp, "99/03/29,15:16:59+08") ||
+        info.encoding != encoding || info.ref != ref || info.total != total || info.seq != seq ||
+        n != data_len || memcmp(out, data, n)){
+        printf("FAIL %d: %s %s enc %d ref %d %d/%d \"%.*s\"\n", sample, info.sender, info.timestamp,
+               info.encoding, info.ref, info.seq, info.total, n, out);
+        return false;
+    }
+    return true;
+}
+
+//Copy the input into an exact sized buffer so reads past the end are caught
+static void run(const uint8_t *data, size_t size){
+    uint8_t *pdu = (uint8_t *)malloc(size ? size : 1);
+    memcpy(pdu, data, size);
+    sms_pdu info;
+    if (sms_parse_pdu(pdu, size, &info)){
+        if (!memchr(info.sender, '\0', sizeof(info.sender)) ||
+            !memchr(info.timestamp, '\0', sizeof(info.timestamp)) ||
+            info.ud < pdu || info.ud + info.ud_size != pdu + size ||
+            info.seq == 0 || info.seq > info.total){
+            abort();
+        }
+        //Decode into an exact sized buffer too
+        for (int size = 0; size <= 160; size += 80){
+            char *out = (char *)malloc(size ? size : 1);
+            int n = sms_decode_ud(&info, out, size);
+            if (n < 0 || n > size){
+                abort();
+            }
+            free(out);
+        }
+    }
+    free(pdu);
+    //The hex decoder sees the raw line from the radio
+    char *line = (char *)malloc(size ? size : 1);
+    memcpy(line, data, size);
+    if (sms_hex_decode(line, size) > (int)size / 2){
+        abort();
+    }
+    free(line);
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    run(data, size);
+    return 0;
+}
+
+#ifndef MTSAS_LIBFUZZER
+int main(int argc, char **argv){
+    unsigned long runs = (argc > 1) ? strtoul(argv[1], NULL, 0) : 1000000;
+    static const char binary[] = {0x00, 0x01, (char)0xFF, (char)0x80};
+    static const char ucs2[] = {0x00, 'H', 0x00, 'i'};
+    bool ok = expect(0, "+31641600986", SMS_ENCODING_GSM7, 0, 1, 1, "hellohello a{b}", 15) &&
+              expect(1, "+31641600986", SMS_ENCODING_8BIT, 0, 1, 1, binary, 4) &&
+              expect(2, "+31641600986", SMS_ENCODING_8BIT, 0, 1, 1, binary, 4) &&
+              expect(3, "+31641600986", SMS_ENCODING_UCS2, 0, 1, 1, ucs2, 4) &&
+              expect(4, "+31641600986", SMS_ENCODING_GSM7, 0xA7, 2, 1, "part1", 5) &&
+              expect(5, "+31641600986", SMS_ENCODING_GSM7, 0x1234, 3, 2, "two", 3) &&
+              expect(6, "Alerts", SMS_ENCODING_GSM7, 0, 1, 1, "hi", 2);
+    //An SMS-SUBMIT, a truncated PDU and bad hex are refused
+    uint8_t pdu[200];
+    sms_pdu info;
+    int len = decode(samples[0], pdu, sizeof(pdu));
+    pdu[8] = 0x01;
+    ok = ok && !sms_parse_pdu(pdu, len, &info);
+    len = decode(samples[0], pdu, sizeof(pdu));
+    ok = ok && !sms_parse_pdu(pdu, 30, &info);
+    char bad[] = "07911G";
+    ok = ok && sms_hex_decode(bad, strlen(bad)) < 0;
+    if (!ok){
+        printf("known PDUs failed\n");
+        return 1;
+    }
+    uint8_t buf[180];
+    srand(1);
+    for (unsigned long i = 0; i < runs; i++){
+        size_t size;
+        if (i & 1){
+            //Mutate a known PDU
+            size = decode(samples[rand() % SAMPLES], buf, sizeof(buf));
+            for (int n = rand() % 4; n >= 0; n--){
+                buf[rand() % size] = (rand() & 1) ? rand() : buf[rand() % size] ^ (1 << (rand() % 8));
+            }
+            size -= (rand() % 4 == 0) ? rand() % size : 0;
+        }
+        else{
+            size = rand() % sizeof(buf);
+            for (size_t n = 0; n < size; n++){
+                buf[n] = rand();
+            }
+        }
+        run(buf, size);
+    }
+    printf("%lu inputs ok\n", runs);
+    return 0;
+}
+#endif